@@ -0,0 +1,201 @@
+/* Capacity planning from measured phase timings
+g++ -o capacityPlanner -std=c++17 -Wall -Wextra -Wpedantic -Werror
+capacityPlanner.cpp
+
+Usage: capacityPlanner <timings file> <max cores> [cores per machine]
+                       [deadline in hours]
+e.g.   capacityPlanner phaseTimings.txt 256 8
+
+Each line of the timings file is "<phase> <cores> <seconds> [serial|parallel]"
+(lines starting with # are comments). A phase measured with at least two core
+counts is fitted to t(n) = serial + parallel / n. A phase measured with one
+core count only is taken as fully serial, unless it is tagged "parallel".
+From the fitted fractions the speedups according to Amdahl (fixed problem)
+and Gustafson (problem growing with the cores) are predicted, together with
+the cost of a run with the machine-day price of Sebastian/C/exercise-1/cost.c.
+The cheapest core count which meets the deadline (if any) is recommended.
+As the cost is machines x time and the time never drops as fast as the
+machines are added, without a deadline the cheapest run is on one machine
+(1 core with the default of 1 core per machine): give a deadline to trade
+money for time.
+*/
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Pricing, as in cost.c
+unsigned int machineDayPriceCents() {
+  // the price for one machine-day in cents (1/100th of an EURO)
+  // 3765 cents = 37 EURO 65 cents
+  return 3765;
+}
+
+// Same as calculateUsagePrice in cost.c, for a fraction of machine-days
+double calculateUsagePrice(unsigned int unitPriceCents, double noOfUnits) {
+  return unitPriceCents * noOfUnits / 100.0;
+}
+
+//------------------------------------------------------------------------------
+// Amdahl's law, as in answers.txt, and Gustafson's law
+double amdahl(double n, double p) { return 1. / ((1. - p) + p / n); }
+double gustafson(double n, double p) { return (1. - p) + p * n; }
+
+//------------------------------------------------------------------------------
+// The measurements of one phase and their decomposition
+struct Phase {
+  std::vector<std::pair<double, double>> timings; // (cores, seconds)
+  std::string tag;
+  double serial = 0.;   // seconds, independent of the cores
+  double parallel = 0.; // seconds on one core, divided by the cores
+
+  // Least squares fit of t = serial + parallel * x with x = 1 / cores
+  void fit() {
+    double sx = 0., sy = 0., sxx = 0., sxy = 0.;
+    const double n = timings.size();
+    for (auto & timing : timings) {
+      const double x = 1. / timing.first;
+      sx += x;
+      sy += timing.second;
+      sxx += x * x;
+      sxy += x * timing.second;
+    }
+    const double det = n * sxx - sx * sx;
+    if (std::fabs(det) < 1e-12) {
+      // one core count only: trust the tag
+      const double cores = timings.front().first;
+      const double mean = sy / n;
+      if (tag == "parallel")
+        parallel = mean * cores;
+      else
+        serial = mean;
+      return;
+    }
+    parallel = std::max(0., (n * sxy - sx * sy) / det);
+    serial = std::max(0., (sy - parallel * sx) / n);
+  };
+};
+
+//------------------------------------------------------------------------------
+bool readTimings(const std::string & fileName,
+                 std::map<std::string, Phase> & phases) {
+  std::ifstream file(fileName);
+  if (!file.is_open())
+    return false;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    std::string name, tag;
+    double cores, seconds;
+    if (!(fields >> name >> cores >> seconds) || cores <= 0. || seconds < 0.)
+      return false;
+    fields >> tag;
+    Phase & phase = phases[name];
+    phase.timings.emplace_back(cores, seconds);
+    if (!tag.empty())
+      phase.tag = tag;
+  }
+  return !phases.empty();
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <timings file> <max cores> [cores per machine]"
+                 " [deadline in hours]\n";
+    return 1;
+  }
+
+  const int maxCores = std::stoi(argv[2]);
+  const int coresPerMachine = argc > 3 ? std::stoi(argv[3]) : 1;
+  const double deadlineHours = argc > 4 ? std::stod(argv[4]) : 0.;
+
+  std::map<std::string, Phase> phases;
+  if (!readTimings(argv[1], phases)) {
+    std::cerr << "Error reading " << argv[1] << "\n";
+    return 1;
+  }
+  if (maxCores <= 0 || coresPerMachine <= 0 || deadlineHours < 0.) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  // Classify the phases
+  double serial = 0., parallel = 0.;
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "Phase decomposition (seconds on one core):\n";
+  for (auto & entry : phases) {
+    Phase & phase = entry.second;
+    phase.fit();
+    serial += phase.serial;
+    parallel += phase.parallel;
+    const double total = phase.serial + phase.parallel;
+    const double fraction = total > 0. ? phase.parallel / total : 0.;
+    std::cout << "  " << std::setw(16) << entry.first << ": serial "
+              << phase.serial << " parallel " << phase.parallel << " -> "
+              << (fraction > .5 ? "parallel" : "serial") << " phase ("
+              << 100. * fraction << "% parallel)\n";
+  }
+  const double t1 = serial + parallel;
+  if (t1 <= 0.) {
+    std::cerr << "All timings are zero\n";
+    return 1;
+  }
+  const double p = parallel / t1;
+  std::cout << "Parallel fraction P = " << p << ", time on one core " << t1
+            << " s\n\n";
+
+  // Predict, cost, and pick the cheapest configuration within the deadline
+  const unsigned int price = machineDayPriceCents();
+  std::cout << "Price for one machine-day: " << price / 100.0 << " EURO\n"
+            << std::setw(8) << "cores" << std::setw(10) << "machines"
+            << std::setw(12) << "Amdahl S" << std::setw(14) << "Gustafson S"
+            << std::setw(14) << "time [s]" << std::setw(14) << "cost [EURO]"
+            << "\n";
+  // the powers of 2 below maxCores, then maxCores itself
+  std::vector<int> coreCounts;
+  for (int cores = 1; cores < maxCores; cores *= 2)
+    coreCounts.push_back(cores);
+  coreCounts.push_back(maxCores);
+
+  int bestCores = 0;
+  double bestCost = 0., bestTime = 0.;
+  for (int cores : coreCounts) {
+    const int machines = (cores + coresPerMachine - 1) / coresPerMachine;
+    const double time = t1 / amdahl(cores, p);
+    const double cost = calculateUsagePrice(price, machines * time / 86400.);
+    std::cout << std::setw(8) << cores << std::setw(10) << machines
+              << std::setw(12) << amdahl(cores, p) << std::setw(14)
+              << gustafson(cores, p) << std::setw(14) << time << std::setw(14)
+              << cost << "\n";
+    const bool inTime = deadlineHours == 0. || time <= deadlineHours * 3600.;
+    if (inTime && (bestCores == 0 || cost < bestCost ||
+                   (cost == bestCost && time < bestTime))) {
+      bestCores = cores;
+      bestCost = cost;
+      bestTime = time;
+    }
+  }
+
+  if (bestCores == 0) {
+    std::cout << "\nNo configuration up to " << maxCores
+              << " cores meets the deadline of " << deadlineHours << " h\n";
+    return 2;
+  }
+  std::cout << "\nRecommended: " << bestCores << " cores, " << bestTime
+            << " s and " << bestCost << " EURO per run\n";
+  if (deadlineHours == 0.)
+    std::cout << "No deadline given: the cost is machines x time, and the "
+                 "time never drops\nas fast as the machines are added, so "
+                 "the cheapest run always uses one machine\n";
+}
@@ -0,0 +1,333 @@
+/*
+g++ -o parallel_looping -std=c++17 -pthread -g -Wall -Wextra -Wpedantic -Werror
+parallel_looping.cpp -ltbb
+
+Usage: parallel_looping <n threads|seq|par|par_unseq> [sizes]
+                        [max serial seconds]
+e.g.   parallel_looping 500 5,50,500,5000 30
+
+The tools are default constructed in parallel directly into uninitialized
+storage, then traversed with parallel_for_each, either on our own thread pool
+(n threads, the main thread being one of them) or with a std::execution
+policy (the parallel ones need TBB, hence -ltbb). Each index prints into its
+own buffer and the buffers are written in order, so the output is the same
+as the one of the serial loop.
+For every size (default 5,50,500,5000) the wall times are compared with the
+serial construction and loop of looping_solution.cpp. The serial construction
+takes 500 ms per tool: when it would last longer than max serial seconds
+(default 30) it is not run and its time is estimated instead.
+*/
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <execution>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//------------------------------------------------------------------------------
+class Tool {
+public:
+  Tool() : aMember{0} {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+  Tool(const Tool & other) : aMember{other.aMember} {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+  void print(std::ostream & out = std::cout) const {
+    out << "tool: " << aMember << "\n";
+  };
+
+private:
+  int aMember;
+};
+
+//------------------------------------------------------------------------------
+// A fixed set of threads running one index loop at a time. The thread calling
+// forEachIndex() takes part in the loop, then waits for the others.
+class ThreadPool {
+public:
+  ThreadPool(int nThreads) {
+    for (int i = 0; i < nThreads - 1; ++i)
+      m_threads.emplace_back(&ThreadPool::work, this);
+  };
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wakeUp.notify_all();
+    for (auto & thr : m_threads)
+      thr.join();
+  };
+  //---------
+  // Call body(i) for i in [0, n), rethrow the first exception thrown
+  void forEachIndex(size_t n, const std::function<void(size_t)> & body) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_body = &body;
+      m_nIndexes = n;
+      m_nextIndex.store(0);
+      m_nRunning = m_threads.size();
+      m_exception = nullptr;
+      ++m_generation;
+    }
+    m_wakeUp.notify_all();
+    runIndexes(body);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_nRunning == 0; });
+    if (m_exception)
+      std::rethrow_exception(m_exception);
+  };
+
+private:
+  void work() {
+    uint64_t seenGeneration = 0;
+    while (true) {
+      const std::function<void(size_t)> * body = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wakeUp.wait(lock, [&] {
+          return m_stop || m_generation != seenGeneration;
+        });
+        if (m_stop)
+          return;
+        seenGeneration = m_generation;
+        body = m_body;
+      }
+      runIndexes(*body);
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--m_nRunning == 0)
+        m_done.notify_one();
+    }
+  };
+
+  void runIndexes(const std::function<void(size_t)> & body) {
+    for (size_t i = m_nextIndex.fetch_add(1); i < m_nIndexes;
+         i = m_nextIndex.fetch_add(1)) {
+      try {
+        body(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_exception)
+          m_exception = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_wakeUp;
+  std::condition_variable m_done;
+  const std::function<void(size_t)> * m_body = nullptr;
+  size_t m_nIndexes = 0;
+  std::atomic<size_t> m_nextIndex{0};
+  size_t m_nRunning = 0;
+  uint64_t m_generation = 0;
+  bool m_stop = false;
+  std::exception_ptr m_exception;
+};
+
+//------------------------------------------------------------------------------
+// parallel_for_each on our thread pool, or with a std::execution policy
+template <class Iterator, class Function>
+void parallel_for_each(ThreadPool & pool, Iterator first, Iterator last,
+                       Function f) {
+  pool.forEachIndex(last - first, [&](size_t i) { f(first[i]); });
+}
+
+template <class Policy, class Iterator, class Function,
+          class = std::enable_if_t<
+              std::is_execution_policy_v<std::decay_t<Policy>>>>
+void parallel_for_each(Policy && policy, Iterator first, Iterator last,
+                       Function f) {
+  std::for_each(std::forward<Policy>(policy), first, last, f);
+}
+
+//------------------------------------------------------------------------------
+// Default construct [first, last) in parallel. If a constructor throws, the
+// objects already built are destroyed and the exception is rethrown.
+template <class T>
+void uninitialized_default_construct(ThreadPool & pool, T * first, T * last) {
+  std::vector<char> constructed(last - first, 0);
+  try {
+    pool.forEachIndex(last - first, [&](size_t i) {
+      new (first + i) T();
+      constructed[i] = 1;
+    });
+  } catch (...) {
+    for (T * p = first; p != last; ++p)
+      if (constructed[p - first])
+        p->~T();
+    throw;
+  }
+}
+
+template <class Policy, class T,
+          class = std::enable_if_t<
+              std::is_execution_policy_v<std::decay_t<Policy>>>>
+void uninitialized_default_construct(Policy && policy, T * first, T * last) {
+  std::uninitialized_default_construct(std::forward<Policy>(policy), first,
+                                       last);
+}
+
+//------------------------------------------------------------------------------
+// Fixed size array whose elements are default constructed in parallel
+template <class T> class ParallelArray {
+public:
+  template <class Executor>
+  ParallelArray(Executor && executor, size_t size)
+      : m_size(size), m_data(std::allocator<T>().allocate(size)) {
+    try {
+      uninitialized_default_construct(executor, m_data, m_data + m_size);
+    } catch (...) {
+      std::allocator<T>().deallocate(m_data, m_size);
+      throw;
+    }
+  }
+  ~ParallelArray() {
+    std::destroy(m_data, m_data + m_size);
+    std::allocator<T>().deallocate(m_data, m_size);
+  };
+  ParallelArray(const ParallelArray &) = delete;
+  ParallelArray & operator=(const ParallelArray &) = delete;
+  //---------
+  size_t size() const { return m_size; };
+  const T * begin() const { return m_data; };
+  const T * end() const { return m_data + m_size; };
+  const T & operator[](size_t i) const { return m_data[i]; };
+
+private:
+  const size_t m_size;
+  T * m_data;
+};
+
+//------------------------------------------------------------------------------
+// The serial loop of looping_solution.cpp, with the index in front of each line
+template <class Tools> void rangeLoop(const Tools & tools, std::ostream & out) {
+  size_t i = 0;
+  for (const auto & tool : tools) {
+    out << i++ << " ";
+    tool.print(out);
+  }
+}
+
+// The same in parallel: every tool prints into its own buffer, and the
+// buffers are written in order at the end
+template <class Executor>
+void parallelRangeLoop(Executor && executor, const ParallelArray<Tool> & tools,
+                       std::ostream & out) {
+  std::vector<std::string> lines(tools.size());
+  auto printTool = [&](const Tool & tool) {
+    const size_t i = &tool - tools.begin();
+    std::ostringstream buffer;
+    buffer << i << " ";
+    tool.print(buffer);
+    lines[i] = buffer.str();
+  };
+  parallel_for_each(executor, tools.begin(), tools.end(), printTool);
+  for (auto & line : lines)
+    out << line;
+}
+
+//------------------------------------------------------------------------------
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+template <class Executor>
+bool benchmark(Executor && executor, const std::vector<size_t> & sizes,
+               double maxSerialSeconds) {
+  std::cout << std::setw(8) << "tools" << std::setw(20) << "serial build [s]"
+            << std::setw(20) << "parallel build [s]" << std::setw(16)
+            << "serial loop [s]" << std::setw(18) << "parallel loop [s]"
+            << std::setw(10) << "speedup"
+            << "  same output\n";
+  bool allSame = true;
+  for (size_t n : sizes) {
+    std::ostringstream serialBuild;
+    double serialSeconds = n * 0.5;
+    if (serialSeconds <= maxSerialSeconds) {
+      auto start = std::chrono::steady_clock::now();
+      std::vector<Tool> serialTools(n);
+      serialSeconds = secondsSince(start);
+      serialBuild << serialSeconds;
+    } else {
+      serialBuild << serialSeconds << " (est.)";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    ParallelArray<Tool> tools(executor, n);
+    const double parallelSeconds = secondsSince(start);
+
+    std::ostringstream serialOut, parallelOut;
+    start = std::chrono::steady_clock::now();
+    rangeLoop(tools, serialOut);
+    const double serialLoopSeconds = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    parallelRangeLoop(executor, tools, parallelOut);
+    const double parallelLoopSeconds = secondsSince(start);
+
+    const bool same = serialOut.str() == parallelOut.str();
+    allSame &= same;
+    std::cout << std::setw(8) << n << std::setw(20) << serialBuild.str()
+              << std::setw(20) << parallelSeconds << std::setw(16)
+              << serialLoopSeconds << std::setw(18) << parallelLoopSeconds
+              << std::setw(10) << serialSeconds / parallelSeconds << "  "
+              << (same ? "yes" : "NO") << "\n";
+  }
+  return allSame;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc < 2 || argc > 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " <n threads|seq|par|par_unseq> [sizes]"
+                 " [max serial seconds]\n";
+    return 1;
+  }
+
+  const std::string executor = argv[1];
+  std::vector<size_t> sizes;
+  std::istringstream sizeList(argc > 2 ? argv[2] : "5,50,500,5000");
+  std::string size;
+  while (std::getline(sizeList, size, ','))
+    sizes.push_back(std::stoul(size));
+  const double maxSerialSeconds = argc > 3 ? std::stod(argv[3]) : 30.;
+
+  if (sizes.empty() || maxSerialSeconds < 0.) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  bool same = true;
+  if (executor == "seq") {
+    same = benchmark(std::execution::seq, sizes, maxSerialSeconds);
+  } else if (executor == "par") {
+    same = benchmark(std::execution::par, sizes, maxSerialSeconds);
+  } else if (executor == "par_unseq") {
+    same = benchmark(std::execution::par_unseq, sizes, maxSerialSeconds);
+  } else {
+    const int nThreads = std::stoi(executor);
+    if (nThreads <= 0) {
+      std::cerr << "Invalid input parameter(s) value(s)\n";
+      return 1;
+    }
+    ThreadPool pool(nThreads);
+    same = benchmark(pool, sizes, maxSerialSeconds);
+  }
+  return same ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+/*
+g++ -o tracked_looping -std=c++17 -pthread -g -rdynamic -Wall -Wextra
+-Wpedantic -Werror tracked_looping.cpp
+
+Usage: tracked_looping
+       TRACKED_BACKTRACE=1 tracked_looping (stack trace of every copy)
+
+The loops of range_looping.cpp and looping_solution.cpp, with the Tool
+wrapped in Tracked<Tool>: every construction, copy and move is counted and
+timed, so the accidental copies (500 ms each) show up in the reports.
+MoveOnly<Tool> goes one step further: its copy constructor is deleted, so a
+loop or a function which would copy the tools does not compile anymore.
+*/
+#include <cxxabi.h>
+#include <execinfo.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Counters and timers of the special member functions of one tracked type
+class TrackedStats {
+public:
+  enum Kind {
+    kConstruction,
+    kCopy,
+    kMove,
+    kCopyAssignment,
+    kMoveAssignment,
+    kNkinds
+  };
+
+  TrackedStats(const std::string & name) : m_name(name){};
+  ~TrackedStats() { print("at exit", false); };
+  //---------
+  void record(Kind kind, std::chrono::steady_clock::duration elapsed) {
+    m_counts[kind].fetch_add(1, std::memory_order_relaxed);
+    m_nanoseconds[kind].fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+    if ((kind == kCopy || kind == kCopyAssignment) && isBacktraceEnabled())
+      printBacktrace(kind);
+  };
+  //---------
+  // Print the counts since the previous report, or the totals
+  void print(const std::string & label, bool sinceLastReport = true) {
+    std::cout << m_name << " " << label << ":\n";
+    for (int kind = 0; kind < kNkinds; ++kind) {
+      uint64_t count = m_counts[kind].load(std::memory_order_relaxed);
+      uint64_t nanoseconds =
+          m_nanoseconds[kind].load(std::memory_order_relaxed);
+      if (sinceLastReport) {
+        std::swap(count, m_lastCounts[kind]);
+        count = m_lastCounts[kind] - count;
+        std::swap(nanoseconds, m_lastNanoseconds[kind]);
+        nanoseconds = m_lastNanoseconds[kind] - nanoseconds;
+      }
+      std::cout << "  " << std::setw(16) << kKindNames[kind] << std::setw(10)
+                << count << " times " << std::setw(12) << nanoseconds * 1e-6
+                << " ms\n";
+    }
+  };
+
+private:
+  static constexpr const char * kKindNames[kNkinds] = {
+      "constructions", "copies", "moves", "copy assigns", "move assigns"};
+
+  // Set TRACKED_BACKTRACE=1 to get the stack trace of every copy
+  static bool isBacktraceEnabled() {
+    static const bool enabled = [] {
+      const char * value = std::getenv("TRACKED_BACKTRACE");
+      return value && std::strcmp(value, "0") != 0;
+    }();
+    return enabled;
+  };
+
+  void printBacktrace(Kind kind) {
+    void * frames[32];
+    const int nFrames = backtrace(frames, 32);
+    std::cerr << "--- " << kKindNames[kind] << " of " << m_name << "\n";
+    std::cerr.flush();
+    backtrace_symbols_fd(frames, nFrames, 2);
+  };
+
+  const std::string m_name;
+  std::atomic<uint64_t> m_counts[kNkinds] = {};
+  std::atomic<uint64_t> m_nanoseconds[kNkinds] = {};
+  uint64_t m_lastCounts[kNkinds] = {};
+  uint64_t m_lastNanoseconds[kNkinds] = {};
+};
+
+//------------------------------------------------------------------------------
+// Base class of Tracked<T> which is constructed before T: its time stamp is
+// taken just before the constructor of T starts
+struct TrackedClock {
+  std::chrono::steady_clock::time_point m_start =
+      std::chrono::steady_clock::now();
+};
+
+//------------------------------------------------------------------------------
+// Tracked<T> behaves like T, but its constructions, copies and moves are
+// counted and timed. The totals are printed when the program exits, and
+// Tracked<T>::report() prints what happened since the previous report.
+// With TRACKED_BACKTRACE=1 in the environment every copy prints the stack
+// trace which led to it (link with -rdynamic to get the function names).
+template <class T> class Tracked : private TrackedClock, public T {
+public:
+  Tracked() : T() { record(TrackedStats::kConstruction); };
+  template <class Arg, class... Args,
+            class = std::enable_if_t<
+                !std::is_base_of_v<Tracked, std::decay_t<Arg>>>>
+  Tracked(Arg && arg, Args &&... args)
+      : T(std::forward<Arg>(arg), std::forward<Args>(args)...) {
+    record(TrackedStats::kConstruction);
+  }
+  Tracked(const Tracked & other) : TrackedClock(), T(other) {
+    record(TrackedStats::kCopy);
+  };
+  Tracked(Tracked && other) noexcept(std::is_nothrow_move_constructible_v<T>)
+      : TrackedClock(), T(std::move(other)) {
+    record(TrackedStats::kMove);
+  };
+  //---------
+  Tracked & operator=(const Tracked & other) {
+    m_start = std::chrono::steady_clock::now();
+    T::operator=(other);
+    record(TrackedStats::kCopyAssignment);
+    return *this;
+  };
+  //---------
+  Tracked & operator=(Tracked && other) noexcept(
+      std::is_nothrow_move_assignable_v<T>) {
+    m_start = std::chrono::steady_clock::now();
+    T::operator=(std::move(other));
+    record(TrackedStats::kMoveAssignment);
+    return *this;
+  };
+  //---------
+  static void report(const std::string & label) { stats().print(label); };
+
+private:
+  static TrackedStats & stats() {
+    static TrackedStats s_stats(typeName());
+    return s_stats;
+  };
+
+  static std::string typeName() {
+    int status = 0;
+    char * name = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr,
+                                      &status);
+    std::string result = status == 0 ? name : typeid(T).name();
+    std::free(name);
+    return result;
+  };
+
+  void record(TrackedStats::Kind kind) {
+    stats().record(kind, std::chrono::steady_clock::now() - m_start);
+  };
+};
+
+//------------------------------------------------------------------------------
+// Tracked<T> which cannot be copied: for containers of expensive objects
+template <class T> class MoveOnly : public Tracked<T> {
+public:
+  using Tracked<T>::Tracked;
+  MoveOnly() = default;
+  MoveOnly(const MoveOnly &) = delete;
+  MoveOnly(MoveOnly &&) = default;
+  MoveOnly & operator=(const MoveOnly &) = delete;
+  MoveOnly & operator=(MoveOnly &&) = default;
+};
+
+//------------------------------------------------------------------------------
+class Tool {
+public:
+  Tool() : aMember{0} {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+  Tool(const Tool & other) : aMember{other.aMember} {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+  // moving a tool is cheap, and lets the containers grow without copies
+  Tool(Tool &&) noexcept = default;
+  void print() const { std::cout << "tool: " << aMember << "\n"; };
+
+private:
+  int aMember;
+};
+
+using TrackedTool = Tracked<Tool>;
+
+//------------------------------------------------------------------------------
+// As in range_looping.cpp: one copy for the argument, one per iteration
+void rangeLoopByValue(std::vector<TrackedTool> tools) {
+  for (auto tool : tools) {
+    tool.print();
+  }
+}
+
+// As in looping_solution.cpp: no copy at all
+template <class Tools> void rangeLoop(const Tools & tools) {
+  for (const auto & tool : tools) {
+    tool.print();
+  }
+}
+
+//------------------------------------------------------------------------------
+int main() {
+  // create a vector of 5 Tools
+  std::cout << "Creating tools" << "\n";
+  std::vector<TrackedTool> tools(5);
+  TrackedTool::report("creating the tools");
+
+  std::cout << "Start range looping by value" << "\n";
+  rangeLoopByValue(tools);
+  TrackedTool::report("range looping by value");
+
+  std::cout << "Start range looping by reference" << "\n";
+  rangeLoop(tools);
+  TrackedTool::report("range looping by reference");
+
+  // rangeLoopByValue(moveOnlyTools) or "for (auto tool : moveOnlyTools)"
+  // would not compile
+  std::cout << "Creating move only tools" << "\n";
+  std::vector<MoveOnly<Tool>> moveOnlyTools;
+  for (int i = 0; i < 5; ++i)
+    moveOnlyTools.emplace_back(); // the reallocations move
+  std::cout << "Start range looping the move only tools" << "\n";
+  rangeLoop(moveOnlyTools);
+  TrackedTool::report("move only tools");
+
+  return 0;
+}
@@ -0,0 +1,191 @@
+/* False sharing benchmark
+g++ -o falseSharing -std=c++17 -pthread -O2 -Wall -Wextra -Wpedantic -Werror
+falseSharing.cpp
+
+Usage: falseSharing <increments per thread> <n threads> [layout ...]
+e.g.   falseSharing 100000000 4 same adjacent padded 256
+
+Every thread runs the incrementCounter loop of example2.cpp on its own
+counter, so there is no race, but the counters are placed in one buffer at a
+given stride:
+  same:     8 bytes, all the counters share one cache line
+  adjacent: 64 bytes, one line per counter, neighbouring lines
+  padded:   128 bytes, one line per counter and an empty line in between
+            (the adjacent line prefetcher fetches lines in pairs)
+  <number>: any stride in bytes, multiple of 8
+For every layout the throughput is printed, together with the cache misses
+and the cache miss rate read with perf_event_open when the kernel allows it
+(see /proc/sys/kernel/perf_event_paranoid).
+*/
+#include <asm/unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Hardware counter of the calling process and of the threads it creates later
+class PerfCounter {
+public:
+  PerfCounter(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1; // count the threads spawned while enabled
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    m_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  };
+  ~PerfCounter() {
+    if (m_fd >= 0)
+      close(m_fd);
+  };
+  PerfCounter(const PerfCounter &) = delete;
+  PerfCounter & operator=(const PerfCounter &) = delete;
+  //---------
+  bool isAvailable() { return m_fd >= 0; };
+  //---------
+  void start() {
+    if (m_fd < 0)
+      return;
+    ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+  };
+  //---------
+  void stop() {
+    if (m_fd >= 0)
+      ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+  };
+  //---------
+  uint64_t read() {
+    uint64_t value = 0;
+    if (m_fd < 0 || ::read(m_fd, &value, sizeof(value)) != sizeof(value))
+      return 0;
+    return value;
+  };
+
+private:
+  long m_fd;
+};
+
+//------------------------------------------------------------------------------
+// The loop of example2.cpp. A counter has a single writer, so a relaxed load
+// and store are enough: the atomic only prevents the compiler from keeping
+// the counter in a register, which would hide the memory traffic.
+void incrementCounter(std::atomic<long> * counter, const unsigned int times) {
+  for (unsigned int i = 0; i < times; ++i) {
+    counter->store(counter->load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+  }
+}
+
+//------------------------------------------------------------------------------
+size_t parseStride(const std::string & layout) {
+  if (layout == "same")
+    return sizeof(long);
+  if (layout == "adjacent")
+    return 64;
+  if (layout == "padded")
+    return 128;
+  return std::stoul(layout);
+}
+
+//------------------------------------------------------------------------------
+// Run the threads on counters 'stride' bytes apart and print the results
+bool benchmark(const std::string & layout, unsigned int times, int nThreads) {
+  const size_t stride = parseStride(layout);
+  if (stride < sizeof(long) || stride % sizeof(long) != 0) {
+    std::cerr << "Invalid stride: " << layout << "\n";
+    return false;
+  }
+  // the buffer starts on a cache line boundary
+  const size_t bufferSize = (stride * nThreads + 63) / 64 * 64;
+  char * buffer = static_cast<char *>(std::aligned_alloc(64, bufferSize));
+  auto counterAt = [&](int i) {
+    return reinterpret_cast<std::atomic<long> *>(buffer + i * stride);
+  };
+  for (int i = 0; i < nThreads; ++i)
+    new (counterAt(i)) std::atomic<long>(0);
+
+  PerfCounter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  PerfCounter references(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+  misses.start();
+  references.start();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i)
+    threads.emplace_back(incrementCounter, counterAt(i), times);
+  for (auto & thr : threads)
+    thr.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  misses.stop();
+  references.stop();
+
+  bool correct = true;
+  for (int i = 0; i < nThreads; ++i)
+    correct &= counterAt(i)->load() == long(times);
+  std::free(buffer);
+
+  const double increments = double(times) * nThreads;
+  std::cout << std::setw(10) << layout << std::setw(8) << stride
+            << std::setw(16) << increments / elapsed.count();
+  if (misses.isAvailable() && references.isAvailable()) {
+    const double nMisses = misses.read();
+    const double nReferences = references.read();
+    std::cout << std::setw(16) << nMisses << std::setw(14)
+              << nMisses / increments << std::setw(12)
+              << (nReferences > 0. ? 100. * nMisses / nReferences : 0.);
+  } else {
+    std::cout << std::setw(16) << "n/a" << std::setw(14) << "n/a"
+              << std::setw(12) << "n/a";
+  }
+  std::cout << (correct ? "" : "  WRONG COUNT") << "\n";
+  return correct;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <increments per thread> <n threads> [layout ...]\n";
+    return 1;
+  }
+
+  const long times = std::stol(argv[1]);
+  const int nThreads = std::stoi(argv[2]);
+  std::vector<std::string> layouts(argv + 3, argv + argc);
+  if (layouts.empty())
+    layouts = {"same", "adjacent", "padded"};
+
+  if (times <= 0 || times > long(~0u) || nThreads <= 0) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << nThreads << " threads, " << times << " increments each\n"
+            << std::setw(10) << "layout" << std::setw(8) << "stride"
+            << std::setw(16) << "increments/s" << std::setw(16)
+            << "cache misses" << std::setw(14) << "misses/incr"
+            << std::setw(12) << "miss rate %"
+            << "\n";
+  bool correct = true;
+  for (auto & layout : layouts)
+    correct &= benchmark(layout, times, nThreads);
+  return correct ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+/* A counter split in per thread slots, each on its own cache line
+g++ -o shardedCounter -std=c++17 -pthread -O2 -Wall -Wextra -Wpedantic -Werror
+shardedCounter.cpp
+
+Usage: shardedCounter [total increments] [max threads]
+
+Every thread increments its own slot, and reading the counter sums the slots:
+the increments never fight for a cache line, only the (rare) reads do.
+Three kinds of slot are available behind the same interface:
+  relaxed: a load and a store, correct because a slot has a single writer
+  atomic:  a fetch_add, i.e. a locked read-modify-write on x86
+  mutex:   a plain integer protected by a mutex
+and the single std::atomic<int> of Solution/example1.cpp is measured too.
+By default the 1000100000 increments of example2.cpp are spread over 1, 2, 4,
+... 64 threads, and the result is checked against the expected value.
+*/
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Every living thread owns one shard index. The index is given back when the
+// thread ends, so that any number of short lived threads can be served.
+constexpr size_t kMaxShards = 256;
+
+std::mutex gShardMutex;
+std::vector<size_t> gFreeShards;
+std::atomic<size_t> gNshards{0}; // high water mark, read without the mutex
+
+struct ShardId {
+  ShardId() {
+    std::lock_guard<std::mutex> lock(gShardMutex);
+    if (!gFreeShards.empty()) {
+      id = gFreeShards.back();
+      gFreeShards.pop_back();
+      return;
+    }
+    id = gNshards.load(std::memory_order_relaxed);
+    if (id == kMaxShards) {
+      std::cerr << "More than " << kMaxShards << " threads\n";
+      std::abort();
+    }
+    gNshards.store(id + 1, std::memory_order_release);
+  };
+  ~ShardId() {
+    std::lock_guard<std::mutex> lock(gShardMutex);
+    gFreeShards.push_back(id);
+  };
+  size_t id;
+};
+
+thread_local ShardId tShard;
+
+//------------------------------------------------------------------------------
+// The slots. Only the owner thread writes a slot, anybody can read it.
+struct RelaxedSlot {
+  static constexpr const char * kName = "relaxed";
+  std::atomic<uint64_t> m_value{0};
+  void add(uint64_t n) {
+    m_value.store(m_value.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  };
+  uint64_t get() { return m_value.load(std::memory_order_relaxed); };
+};
+
+struct AtomicSlot {
+  static constexpr const char * kName = "atomic";
+  std::atomic<uint64_t> m_value{0};
+  void add(uint64_t n) { m_value.fetch_add(n); };
+  uint64_t get() { return m_value.load(); };
+};
+
+struct MutexSlot {
+  static constexpr const char * kName = "mutex";
+  std::mutex m_mutex;
+  uint64_t m_value = 0;
+  void add(uint64_t n) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_value += n;
+  };
+  uint64_t get() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_value;
+  };
+};
+
+//------------------------------------------------------------------------------
+// The counter: one padded slot per shard, summed on read. The sum is exact
+// once the writers are done, and a lower bound of the count while they run.
+template <class Slot> class ShardedCounter {
+public:
+  static constexpr const char * kName = Slot::kName;
+  //---------
+  void add(uint64_t n = 1) { m_slots[tShard.id].add(n); };
+  //---------
+  uint64_t get() {
+    uint64_t sum = 0;
+    const size_t nShards = gNshards.load(std::memory_order_acquire);
+    for (size_t i = 0; i < nShards; ++i)
+      sum += m_slots[i].get();
+    return sum;
+  };
+
+private:
+  struct alignas(64) PaddedSlot : Slot {};
+  std::array<PaddedSlot, kMaxShards> m_slots;
+};
+
+//------------------------------------------------------------------------------
+// The reference: all the threads increment the same atomic
+class SharedCounter {
+public:
+  static constexpr const char * kName = "shared";
+  void add(uint64_t n = 1) { m_value.fetch_add(n); };
+  uint64_t get() { return m_value.load(); };
+
+private:
+  std::atomic<uint64_t> m_value{0};
+};
+
+//------------------------------------------------------------------------------
+template <class Counter>
+void incrementCounter(Counter * counter, const uint64_t times) {
+  for (uint64_t i = 0; i < times; ++i) {
+    counter->add();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Spread 'total' increments over nThreads, print the rate and check the sum
+template <class Counter> bool benchmark(uint64_t total, int nThreads) {
+  auto counter = std::make_unique<Counter>();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i) {
+    const uint64_t times = total / nThreads + (i == 0 ? total % nThreads : 0);
+    threads.emplace_back(incrementCounter<Counter>, counter.get(), times);
+  }
+  for (auto & thr : threads)
+    thr.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  const uint64_t value = counter->get();
+  const bool correct = value == total;
+  std::cout << std::setw(8) << Counter::kName << std::setw(8) << nThreads
+            << std::setw(16) << total / elapsed.count() << std::setw(12)
+            << elapsed.count() << "  " << (correct ? "ok" : "WRONG: ")
+            << (correct ? "" : std::to_string(value)) << "\n";
+  return correct;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " [total increments] [max threads]\n";
+    return 1;
+  }
+
+  const uint64_t total = argc > 1 ? std::stoull(argv[1]) : 1000100000ULL;
+  const int maxThreads = argc > 2 ? std::stoi(argv[2]) : 64;
+
+  if (total == 0 || maxThreads <= 0 || maxThreads > int(kMaxShards)) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << "Expected value: " << total << "\n"
+            << std::setw(8) << "variant" << std::setw(8) << "threads"
+            << std::setw(16) << "increments/s" << std::setw(12) << "time [s]"
+            << "  result\n";
+  bool correct = true;
+  for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+    correct &= benchmark<SharedCounter>(total, nThreads);
+    correct &= benchmark<ShardedCounter<RelaxedSlot>>(total, nThreads);
+    correct &= benchmark<ShardedCounter<AtomicSlot>>(total, nThreads);
+    correct &= benchmark<ShardedCounter<MutexSlot>>(total, nThreads);
+  }
+  return correct ? 0 : 1;
+}
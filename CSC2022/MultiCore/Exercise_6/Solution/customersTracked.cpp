@@ -0,0 +1,296 @@
+/*
+g++ -o customersTracked customersTracked.cpp -std=c++17 -g -rdynamic
+
+Usage: customersTracked inputData.txt
+       TRACKED_BACKTRACE=1 customersTracked inputData.txt (stack trace of
+       every copy)
+
+The Customer of customers.cpp loses its hand written copy counters: it is
+wrapped in Tracked<Customer> instead, which counts and times all the
+constructions, copies and moves. The data is loaded twice, with the
+containers of customers.cpp and with the ones of customersOpt.cpp, and the
+copies of each version are reported.
+*/
+#include <cxxabi.h>
+#include <execinfo.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Counters and timers of the special member functions of one tracked type
+class TrackedStats {
+public:
+  enum Kind {
+    kConstruction,
+    kCopy,
+    kMove,
+    kCopyAssignment,
+    kMoveAssignment,
+    kNkinds
+  };
+
+  TrackedStats(const std::string & name) : m_name(name){};
+  ~TrackedStats() { print("at exit", false); };
+  //---------
+  void record(Kind kind, std::chrono::steady_clock::duration elapsed) {
+    m_counts[kind].fetch_add(1, std::memory_order_relaxed);
+    m_nanoseconds[kind].fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+    if ((kind == kCopy || kind == kCopyAssignment) && isBacktraceEnabled())
+      printBacktrace(kind);
+  };
+  //---------
+  // Print the counts since the previous report, or the totals
+  void print(const std::string & label, bool sinceLastReport = true) {
+    std::cout << m_name << " " << label << ":\n";
+    for (int kind = 0; kind < kNkinds; ++kind) {
+      uint64_t count = m_counts[kind].load(std::memory_order_relaxed);
+      uint64_t nanoseconds =
+          m_nanoseconds[kind].load(std::memory_order_relaxed);
+      if (sinceLastReport) {
+        std::swap(count, m_lastCounts[kind]);
+        count = m_lastCounts[kind] - count;
+        std::swap(nanoseconds, m_lastNanoseconds[kind]);
+        nanoseconds = m_lastNanoseconds[kind] - nanoseconds;
+      }
+      std::cout << "  " << std::setw(16) << kKindNames[kind] << std::setw(10)
+                << count << " times " << std::setw(12) << nanoseconds * 1e-6
+                << " ms\n";
+    }
+  };
+
+private:
+  static constexpr const char * kKindNames[kNkinds] = {
+      "constructions", "copies", "moves", "copy assigns", "move assigns"};
+
+  // Set TRACKED_BACKTRACE=1 to get the stack trace of every copy
+  static bool isBacktraceEnabled() {
+    static const bool enabled = [] {
+      const char * value = std::getenv("TRACKED_BACKTRACE");
+      return value && std::strcmp(value, "0") != 0;
+    }();
+    return enabled;
+  };
+
+  void printBacktrace(Kind kind) {
+    void * frames[32];
+    const int nFrames = backtrace(frames, 32);
+    std::cerr << "--- " << kKindNames[kind] << " of " << m_name << "\n";
+    std::cerr.flush();
+    backtrace_symbols_fd(frames, nFrames, 2);
+  };
+
+  const std::string m_name;
+  std::atomic<uint64_t> m_counts[kNkinds] = {};
+  std::atomic<uint64_t> m_nanoseconds[kNkinds] = {};
+  uint64_t m_lastCounts[kNkinds] = {};
+  uint64_t m_lastNanoseconds[kNkinds] = {};
+};
+
+//------------------------------------------------------------------------------
+// Base class of Tracked<T> which is constructed before T: its time stamp is
+// taken just before the constructor of T starts
+struct TrackedClock {
+  std::chrono::steady_clock::time_point m_start =
+      std::chrono::steady_clock::now();
+};
+
+//------------------------------------------------------------------------------
+// Tracked<T> behaves like T, but its constructions, copies and moves are
+// counted and timed. The totals are printed when the program exits, and
+// Tracked<T>::report() prints what happened since the previous report.
+// With TRACKED_BACKTRACE=1 in the environment every copy prints the stack
+// trace which led to it (link with -rdynamic to get the function names).
+template <class T> class Tracked : private TrackedClock, public T {
+public:
+  Tracked() : T() { record(TrackedStats::kConstruction); };
+  template <class Arg, class... Args,
+            class = std::enable_if_t<
+                !std::is_base_of_v<Tracked, std::decay_t<Arg>>>>
+  Tracked(Arg && arg, Args &&... args)
+      : T(std::forward<Arg>(arg), std::forward<Args>(args)...) {
+    record(TrackedStats::kConstruction);
+  }
+  Tracked(const Tracked & other) : TrackedClock(), T(other) {
+    record(TrackedStats::kCopy);
+  };
+  Tracked(Tracked && other) noexcept(std::is_nothrow_move_constructible_v<T>)
+      : TrackedClock(), T(std::move(other)) {
+    record(TrackedStats::kMove);
+  };
+  //---------
+  Tracked & operator=(const Tracked & other) {
+    m_start = std::chrono::steady_clock::now();
+    T::operator=(other);
+    record(TrackedStats::kCopyAssignment);
+    return *this;
+  };
+  //---------
+  Tracked & operator=(Tracked && other) noexcept(
+      std::is_nothrow_move_assignable_v<T>) {
+    m_start = std::chrono::steady_clock::now();
+    T::operator=(std::move(other));
+    record(TrackedStats::kMoveAssignment);
+    return *this;
+  };
+  //---------
+  static void report(const std::string & label) { stats().print(label); };
+
+private:
+  static TrackedStats & stats() {
+    static TrackedStats s_stats(typeName());
+    return s_stats;
+  };
+
+  static std::string typeName() {
+    int status = 0;
+    char * name = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr,
+                                      &status);
+    std::string result = status == 0 ? name : typeid(T).name();
+    std::free(name);
+    return result;
+  };
+
+  void record(TrackedStats::Kind kind) {
+    stats().record(kind, std::chrono::steady_clock::now() - m_start);
+  };
+};
+
+//------------------------------------------------------------------------------
+class Customer {
+public:
+  Customer(unsigned int id, const std::string & name,
+           const std::string & company, const std::string & city,
+           const std::string & phone)
+      : m_id(id), m_name(name), m_company(company), m_city(city),
+        m_phone(phone){};
+
+  void Print() {
+    std::cout << "Customer id : " << m_id << "\n"
+              << " o name " << m_name << "\n"
+              << " o company: " << m_company << "\n"
+              << " o city: " << m_city << "\n"
+              << " o phone: " << m_phone << "\n";
+  }
+
+  const char * getName() { return m_name.c_str(); };
+
+private:
+  unsigned int m_id;
+  std::string m_name;
+  std::string m_company;
+  std::string m_city;
+  std::string m_phone;
+};
+
+using TrackedCustomer = Tracked<Customer>;
+
+//------------------------------------------------------------------------------
+void fillCustomerData(const std::string & line,
+                      std::vector<std::string> & data) {
+  char buf[1000];
+  strcpy(buf, line.c_str());
+  char * p = strtok(buf, "|");
+  int dataIndex = 0;
+  while (p) {
+    data[dataIndex++] = p;
+    p = strtok(NULL, "|");
+  }
+}
+
+//------------------------------------------------------------------------------
+// Read the file, calling add(id, data) for every line
+template <class Add>
+int readCustomersData(const std::string filename, Add add) {
+
+  std::ifstream iFile(filename);
+  if (!iFile.is_open()) {
+    std::cerr << "Error opening " << filename << "\n";
+    return -1;
+  }
+
+  std::string line;
+  std::vector<std::string> data(4);
+  unsigned int id = 0;
+  while (!iFile.eof()) {
+    std::getline(iFile, line);
+    fillCustomerData(line, data);
+    add(id++, data);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// The containers of customers.cpp
+int loadAsCustomers(const std::string filename) {
+  std::vector<TrackedCustomer> customers;
+  std::vector<std::vector<TrackedCustomer>> customersAlphabetic(26);
+
+  auto add = [&customers](unsigned int id, std::vector<std::string> & data) {
+    TrackedCustomer c(id, data[0], data[1], data[2], data[3]);
+    customers.push_back(c);
+  };
+  if (readCustomersData(filename, add) != 0)
+    return -1;
+  TrackedCustomer::report("reading, as in customers.cpp");
+
+  const char offset = 65;
+  for (auto & customer : customers) {
+    char initial = customer.getName()[0];
+    initial -= offset;
+    customersAlphabetic[(int)initial].push_back(customer);
+  }
+  TrackedCustomer::report("sorting, as in customers.cpp");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// The containers of customersOpt.cpp
+int loadAsCustomersOpt(const std::string filename) {
+  std::deque<TrackedCustomer> customers;
+  std::deque<std::deque<TrackedCustomer *>> customersAlphabetic(26);
+
+  auto add = [&customers](unsigned int id, std::vector<std::string> & data) {
+    customers.emplace_back(id, data[0], data[1], data[2], data[3]);
+  };
+  if (readCustomersData(filename, add) != 0)
+    return -1;
+  TrackedCustomer::report("reading, as in customersOpt.cpp");
+
+  const char offset = 65;
+  for (auto & customer : customers) {
+    char initial = customer.getName()[0];
+    initial -= offset;
+    customersAlphabetic[(int)initial].emplace_back(&customer);
+  }
+  TrackedCustomer::report("sorting, as in customersOpt.cpp");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc != 2) {
+    std::cout << "Missing input file.\n"
+              << "Usage: " << argv[0] << " inputData.txt\n";
+    return 1;
+  }
+
+  if (loadAsCustomers(argv[1]) != 0 || loadAsCustomersOpt(argv[1]) != 0)
+    return 1;
+}
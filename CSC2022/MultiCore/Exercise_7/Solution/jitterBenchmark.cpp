@@ -0,0 +1,221 @@
+/* Cost per call of the jitter generation used by the mail item processors
+g++ jitterBenchmark.cpp -o jitterBenchmark -std=c++17 -O2 -pthread -Wall
+-Wextra -Wpedantic -Werror
+
+Usage: jitterBenchmark <calls per thread> <max threads>
+
+Compares the original implementation, which creates a std::random_device and
+a std::mt19937 at every call, with the per thread JitterSource.
+*/
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Source of the jitter applied to the stage durations.
+// Every thread owns a small xoshiro256** generator (32 bytes of state) which
+// is seeded once, from the global seed and the worker index the thread was
+// given with bindWorker(), the first time the thread asks for a number.
+// Creating a std::random_device and a std::mt19937 at every call is not
+// needed anymore, and a worker draws the same stream whatever the order in
+// which the threads start, so its durations can be reproduced from the seeds
+// printed at the end (which items it runs is still up to the scheduler).
+class Xoshiro256ss {
+public:
+  using result_type = uint64_t;
+
+  explicit Xoshiro256ss(uint64_t seed) {
+    for (auto & s : m_s)
+      s = splitmix64(seed);
+  };
+  static constexpr result_type min() { return 0; };
+  static constexpr result_type max() { return UINT64_MAX; };
+  result_type operator()() {
+    const uint64_t result = rotl(m_s[1] * 5, 7) * 9;
+    const uint64_t t = m_s[1] << 17;
+    m_s[2] ^= m_s[0];
+    m_s[3] ^= m_s[1];
+    m_s[1] ^= m_s[2];
+    m_s[0] ^= m_s[3];
+    m_s[2] ^= t;
+    m_s[3] = rotl(m_s[3], 45);
+    return result;
+  };
+
+  static uint64_t splitmix64(uint64_t & x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  };
+
+private:
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  };
+  uint64_t m_s[4];
+};
+
+class JitterSource {
+public:
+  enum class Distribution { kNormal, kExponential, kTrace };
+
+  JitterSource(uint64_t seed)
+      : m_seed(seed), m_distribution(Distribution::kNormal){};
+
+  // Configure from "normal", "exponential" or "trace:<file>". A trace file
+  // holds one factor per line: the n-th stage of a thread lasts factor * mean.
+  // Returns false if the specification cannot be used.
+  bool configure(const std::string & spec) {
+    if (spec == "normal") {
+      m_distribution = Distribution::kNormal;
+    } else if (spec == "exponential") {
+      m_distribution = Distribution::kExponential;
+    } else if (spec.compare(0, 6, "trace:") == 0) {
+      m_distribution = Distribution::kTrace;
+      std::ifstream traceFile(spec.substr(6));
+      float factor;
+      while (traceFile >> factor)
+        m_trace.push_back(factor);
+      return !m_trace.empty();
+    } else {
+      return false;
+    }
+    return true;
+  };
+
+  // Every thread calls it once before sampling, with an index which does not
+  // depend on the scheduling, e.g. its rank when it is launched
+  static void bindWorker(size_t worker) { tWorker = worker; };
+
+  // Duration around mean, computed with the generator of the calling thread.
+  // The thread state is static: one JitterSource per program is expected.
+  float sample(float mean) {
+    thread_local ThreadState state(registerThread());
+    switch (m_distribution) {
+    case Distribution::kNormal:
+      return std::fabs(mean + mean * .4f * state.normal(state.generator));
+    case Distribution::kExponential:
+      return mean * state.exponential(state.generator);
+    default:
+      state.traceCursor = (state.traceCursor + 1) % m_trace.size();
+      return mean * m_trace[state.traceCursor];
+    }
+  };
+
+  uint64_t getSeed() const { return m_seed; };
+
+  void printSeeds(std::ostream & os) {
+    std::lock_guard<std::mutex> lock(m_threadSeedsMutex);
+    os << "Jitter seed " << m_seed << ", per worker:\n";
+    for (size_t i = 0; i < m_threadSeeds.size(); ++i)
+      if (m_threadSeeds[i] != 0) // 0 if worker i never sampled
+        os << "  worker " << i << " seed " << m_threadSeeds[i] << "\n";
+  };
+
+private:
+  struct ThreadState {
+    ThreadState(std::pair<size_t, uint64_t> indexAndSeed)
+        : generator(indexAndSeed.second), normal(0.f, 1.f),
+          exponential(1.f), traceCursor(indexAndSeed.first){};
+    Xoshiro256ss generator;
+    std::normal_distribution<float> normal;
+    std::exponential_distribution<float> exponential;
+    size_t traceCursor;
+  };
+
+  // Called once per thread: derive the seed from the worker index
+  std::pair<size_t, uint64_t> registerThread() {
+    if (tWorker == kUnbound) {
+      std::cerr << "JitterSource: sampling from a thread without bindWorker\n";
+      std::abort();
+    }
+    std::lock_guard<std::mutex> lock(m_threadSeedsMutex);
+    uint64_t x = m_seed + tWorker;
+    if (m_threadSeeds.size() <= tWorker)
+      m_threadSeeds.resize(tWorker + 1, 0);
+    m_threadSeeds[tWorker] = Xoshiro256ss::splitmix64(x);
+    return {tWorker, m_threadSeeds[tWorker]};
+  };
+
+  static constexpr size_t kUnbound = SIZE_MAX;
+  static thread_local size_t tWorker;
+
+  const uint64_t m_seed;
+  Distribution m_distribution;
+  std::vector<float> m_trace;
+  std::mutex m_threadSeedsMutex;
+  std::vector<uint64_t> m_threadSeeds;
+};
+
+thread_local size_t JitterSource::tWorker = JitterSource::kUnbound;
+
+//------------------------------------------------------------------------------
+// What doWork used to do to compute its duration
+float originalJitter(float mean) {
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::normal_distribution<> d(mean, mean * .4);
+  return std::fabs(d(gen));
+}
+
+//------------------------------------------------------------------------------
+// Run nCalls calls of the generator on nThreads threads, return the average
+// wall time per call in ns
+template <class F> double timePerCall(F generator, int nCalls, int nThreads) {
+  auto work = [&generator, nCalls](int worker) {
+    JitterSource::bindWorker(worker);
+    volatile float sink = 0.f;
+    for (int i = 0; i < nCalls; ++i)
+      sink = generator(.1f);
+    (void)sink;
+  };
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i)
+    threads.emplace_back(work, i);
+  for (auto & thr : threads)
+    thr.join();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / nCalls;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <calls per thread> <max threads>\n";
+    return 1;
+  }
+
+  int nCalls = std::stoi(argv[1]);
+  int maxThreads = std::stoi(argv[2]);
+
+  if (nCalls <= 0 || maxThreads <= 0) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << "threads,distribution,original ns/call,jitter source ns/call\n";
+  for (const char * spec : {"normal", "exponential"}) {
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+      JitterSource jitter(42);
+      jitter.configure(spec);
+      const double original = timePerCall(originalJitter, nCalls, nThreads);
+      const double perThread = timePerCall(
+          [&jitter](float mean) { return jitter.sample(mean); }, nCalls,
+          nThreads);
+      std::cout << nThreads << "," << spec << "," << original << ","
+                << perThread << "\n";
+    }
+  }
+}
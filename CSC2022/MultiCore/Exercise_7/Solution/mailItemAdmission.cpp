@@ -0,0 +1,401 @@
+/* Admission control of the mail pipeline with token buckets
+g++ mailItemAdmission.cpp -o mailItemAdmission -std=c++17 -fgnu-tm -pthread
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemAdmission <mail items> <threads> [time scale] [overload]
+e.g.   mailItemAdmission 2000 8 0.01 2
+
+The items arrive at a fixed rate, overload (default 2) times the capacity of
+the workers, i.e. threads / work of an item. Without admission control every
+item is pushed into the actions queue on arrival, as the pump of the
+solutions does: under overload the queue and the latency of the items grow
+for as long as the run lasts.
+With admission control the producer has to take a token from the bucket of
+every stage before pushing an item, and waits otherwise. Every 20 ms the
+rate of each bucket is set from what was measured on its stage: the rate at
+which the stage completed actions, minus 10% when the backlog of the stage
+(its actions queued or running) is above its target, plus 10% when it is
+above half the target and plus 25% below. The target is four times the
+share of the workers the stage needs (at least 2), so the queue holds just
+enough work to keep every worker busy.
+For both runs the throughput, the depth of the actions queue and the latency
+of the items from admission to mailing are printed, the latency on the items
+of the steady state only (the last 3/4 of the batch). The time the items
+waited to be admitted is printed too: this is where the overload goes.
+The stage durations are the ones of mailItemBetterDesign times the time
+scale (default 0.01).
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Action = std::function<void()>;
+using Duration = std::chrono::duration<float>;
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// Durations of the stages of MailItem::next() in mailItemBetterDesign
+constexpr int kNstages = 6;
+const float gStageDurations[kNstages] = {0.12f, 0.1f, 0.24f,
+                                         0.5f,  0.05f, 0.7f};
+
+//------------------------------------------------------------------------------
+// Token bucket, only used by the producer thread
+class TokenBucket {
+public:
+  TokenBucket(double rate, double burst)
+      : m_rate(rate), m_burst(burst), m_tokens(burst), m_last(Clock::now()){};
+  //---------
+  bool hasToken(Clock::time_point now) {
+    refill(now);
+    return m_tokens >= 1.;
+  };
+  //---------
+  void take() { m_tokens -= 1.; };
+  //---------
+  void setRate(double rate, double burst, Clock::time_point now) {
+    refill(now);
+    m_rate = rate;
+    m_burst = burst;
+    m_tokens = std::min(m_tokens, m_burst);
+  };
+  //---------
+  double getRate() { return m_rate; };
+
+private:
+  void refill(Clock::time_point now) {
+    std::chrono::duration<double> elapsed = now - m_last;
+    m_tokens = std::min(m_burst, m_tokens + elapsed.count() * m_rate);
+    m_last = now;
+  };
+
+  double m_rate;  // tokens per second
+  double m_burst; // bucket size
+  double m_tokens;
+  Clock::time_point m_last;
+};
+
+//------------------------------------------------------------------------------
+struct MailItem {
+  Clock::time_point arrived;
+  Clock::time_point admitted;
+  Clock::time_point mailed;
+};
+
+// Counters of a stage, updated by the workers
+struct alignas(64) StageStats {
+  std::atomic<int64_t> backlog{0}; // actions queued or running
+  std::atomic<int64_t> completed{0};
+};
+
+// What the actions of one run share
+struct Pipeline {
+  Pipeline(size_t items, float scale)
+      : nItems(items), timeScale(scale), queue(items + 1000){};
+  const size_t nItems;
+  const float timeScale;
+  TsQueue<Action *> queue;
+  StageStats stages[kNstages];
+  std::atomic<size_t> nMailed{0};
+  //---------
+  bool isDone() {
+    return nMailed.load(std::memory_order_acquire) == nItems;
+  };
+};
+
+//------------------------------------------------------------------------------
+// One stage of an item, then queue the next one, as in mailItemBetterDesign
+void doMail(int stage, MailItem * item, Pipeline * p) {
+  std::this_thread::sleep_for(Duration(gStageDurations[stage] * p->timeScale));
+  p->stages[stage].completed.fetch_add(1, std::memory_order_relaxed);
+  p->stages[stage].backlog.fetch_sub(1, std::memory_order_relaxed);
+  if (stage + 1 < kNstages) {
+    p->stages[stage + 1].backlog.fetch_add(1, std::memory_order_relaxed);
+    p->queue.push(new Action(std::bind(doMail, stage + 1, item, p)));
+    return;
+  }
+  item->mailed = Clock::now();
+  p->nMailed.fetch_add(1, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// The buckets of the stages and the feedback loop which sets their rates
+class AdmissionController {
+public:
+  AdmissionController(Pipeline * pipeline, int nThreads)
+      : m_pipeline(pipeline), m_lastUpdate(Clock::now()) {
+    float work = 0.f;
+    for (float duration : gStageDurations)
+      work += duration;
+    for (int s = 0; s < kNstages; ++s) {
+      m_targets[s] = std::max(2., 4. * nThreads * gStageDurations[s] / work);
+      // start slowly, the rates are found by probing
+      m_buckets.emplace_back(kInitialRate, 1.);
+      m_lastCompleted[s] = 0;
+    }
+  };
+  //---------
+  // Take one token of every bucket, false if one of them is empty
+  bool tryAdmit(Clock::time_point now) {
+    if (now - m_lastUpdate >= kPeriod)
+      update(now);
+    for (auto & bucket : m_buckets)
+      if (!bucket.hasToken(now))
+        return false;
+    for (auto & bucket : m_buckets)
+      bucket.take();
+    return true;
+  };
+  //---------
+  double getRate() {
+    double rate = m_buckets[0].getRate();
+    for (auto & bucket : m_buckets)
+      rate = std::min(rate, bucket.getRate());
+    return rate;
+  };
+
+private:
+  static constexpr double kInitialRate = 10.;
+  static constexpr std::chrono::milliseconds kPeriod{20};
+
+  void update(Clock::time_point now) {
+    std::chrono::duration<double> elapsed = now - m_lastUpdate;
+    m_lastUpdate = now;
+    for (int s = 0; s < kNstages; ++s) {
+      StageStats & stats = m_pipeline->stages[s];
+      const int64_t completed = stats.completed.load(std::memory_order_relaxed);
+      const double measured =
+          (completed - m_lastCompleted[s]) / elapsed.count();
+      m_lastCompleted[s] = completed;
+      double rate = std::max(measured, kInitialRate);
+      const int64_t backlog = stats.backlog.load(std::memory_order_relaxed);
+      if (backlog > m_targets[s])
+        rate *= 0.9;
+      else if (backlog > m_targets[s] / 2.)
+        rate = std::max(rate, m_buckets[s].getRate()) * 1.1;
+      else
+        rate = std::max(rate, m_buckets[s].getRate()) * 1.25;
+      // allow the tokens of one period to be spent at once
+      const double burst = std::max(1., rate * elapsed.count());
+      m_buckets[s].setRate(rate, burst, now);
+    }
+  };
+
+  Pipeline * const m_pipeline;
+  Clock::time_point m_lastUpdate;
+  std::vector<TokenBucket> m_buckets;
+  double m_targets[kNstages];
+  int64_t m_lastCompleted[kNstages];
+};
+
+//------------------------------------------------------------------------------
+struct RunResults {
+  double makespan;
+  double meanDepth;
+  size_t maxDepth;
+  double finalRate;
+};
+
+// The items arrive every 'interArrival'. The producer admits them, through
+// the controller if there is one, while nThreads workers process them.
+RunResults run(std::vector<MailItem> & items, int nThreads, float timeScale,
+               Duration interArrival, bool control) {
+  Pipeline pipeline(items.size(), timeScale);
+  AdmissionController controller(&pipeline, nThreads);
+  auto work = [&pipeline] {
+    Action * action;
+    while (!pipeline.isDone()) {
+      if (pipeline.queue.try_pop(action)) {
+        (*action)();
+        delete action;
+      } else {
+        std::this_thread::yield(); // leave the core to the producer
+      }
+    }
+  };
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads; ++i)
+    workerThreads.emplace_back(work);
+
+  RunResults results{0., 0., 0, 0.};
+  double depthSum = 0.;
+  size_t nSamples = 0;
+  const Clock::time_point start = Clock::now();
+  Clock::time_point nextSample = start;
+  for (size_t i = 0; i < items.size() || !pipeline.isDone();) {
+    const Clock::time_point now = Clock::now();
+    if (now >= nextSample) {
+      const size_t depth = pipeline.queue.getNitems();
+      depthSum += depth;
+      ++nSamples;
+      results.maxDepth = std::max(results.maxDepth, depth);
+      nextSample = now + std::chrono::milliseconds(1);
+    }
+    if (i == items.size()) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    MailItem & item = items[i];
+    item.arrived = start + std::chrono::duration_cast<Clock::duration>(
+                               interArrival * float(i));
+    if (now < item.arrived || (control && !controller.tryAdmit(now))) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    item.admitted = now;
+    pipeline.stages[0].backlog.fetch_add(1, std::memory_order_relaxed);
+    pipeline.queue.push(new Action(std::bind(doMail, 0, &item, &pipeline)));
+    ++i;
+  }
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  for (auto & thr : workerThreads)
+    thr.join();
+
+  results.makespan = elapsed.count();
+  results.meanDepth = nSamples ? depthSum / nSamples : 0.;
+  results.finalRate = controller.getRate();
+  return results;
+}
+
+//------------------------------------------------------------------------------
+// Percentile in ms of sorted durations
+double percentile(const std::vector<Clock::duration> & sorted, double p) {
+  const size_t i = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+  return std::chrono::duration<double, std::milli>(sorted[i]).count();
+}
+
+void printRun(const char * name, const std::vector<MailItem> & items,
+              const RunResults & results) {
+  std::vector<Clock::duration> latencies, admissionWaits;
+  for (size_t i = items.size() / 4; i < items.size(); ++i) {
+    latencies.push_back(items[i].mailed - items[i].admitted);
+    admissionWaits.push_back(items[i].admitted - items[i].arrived);
+  }
+  std::sort(latencies.begin(), latencies.end());
+  std::sort(admissionWaits.begin(), admissionWaits.end());
+  std::cout << std::setw(10) << name << std::setw(10)
+            << items.size() / results.makespan << std::setw(12)
+            << results.meanDepth << std::setw(11) << results.maxDepth
+            << std::setw(11) << percentile(latencies, 0.5) << std::setw(11)
+            << percentile(latencies, 0.99) << std::setw(11)
+            << percentile(latencies, 1.) << std::setw(16)
+            << percentile(admissionWaits, 0.99) << "\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <threads> [time scale] [overload]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  float timeScale = argc > 3 ? std::stof(argv[3]) : 0.01f;
+  float overload = argc > 4 ? std::stof(argv[4]) : 2.f;
+
+  if (nItems < 4 || nThreads <= 0 || timeScale <= 0.f || overload <= 0.f) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  float work = 0.f;
+  for (float duration : gStageDurations)
+    work += duration * timeScale;
+  const double capacity = nThreads / work;
+  const Duration interArrival(1.f / (overload * capacity));
+
+  std::cout << "Starting with " << nItems << " items and " << nThreads
+            << " threads, capacity " << capacity << " items/s, offered "
+            << overload * capacity << " items/s\n"
+            << "Steady state latencies in ms\n"
+            << std::setw(10) << "admission" << std::setw(10) << "items/s"
+            << std::setw(12) << "mean depth" << std::setw(11) << "max depth"
+            << std::setw(11) << "p50" << std::setw(11) << "p99"
+            << std::setw(11) << "max" << std::setw(16) << "p99 admit wait"
+            << "\n";
+
+  std::vector<MailItem> items(nItems);
+  RunResults results = run(items, nThreads, timeScale, interArrival, false);
+  printRun("none", items, results);
+  results = run(items, nThreads, timeScale, interArrival, true);
+  printRun("bucket", items, results);
+  std::cout << "Admission rate at the end: " << results.finalRate
+            << " items/s\n"
+            << "Work finished, threads joined\n";
+}
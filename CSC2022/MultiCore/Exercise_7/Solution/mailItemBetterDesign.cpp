@@ -3,11 +3,19 @@ g++ mailItemBetterDesign.cpp -o mailItemBetterDesign -std=c++17 -fgnu-tm
 -pthread -lcurses
 */
 #include "curses.h"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 #include <thread>
@@ -89,6 +97,365 @@ using TsActionPtrQueue = TsQueue<Action *>;
 using Duration = std::chrono::duration<float>;
 using TimePoint = std::chrono::time_point<std::chrono::system_clock>;
 
+//------------------------------------------------------------------------------
+// Source of the jitter applied to the stage durations.
+// Every thread owns a small xoshiro256** generator (32 bytes of state) which
+// is seeded once, from the global seed and the worker index the thread was
+// given with bindWorker(), the first time the thread asks for a number.
+// Creating a std::random_device and a std::mt19937 at every call is not
+// needed anymore, and a worker draws the same stream whatever the order in
+// which the threads start, so its durations can be reproduced from the seeds
+// printed at the end (which items it runs is still up to the scheduler).
+class Xoshiro256ss {
+public:
+  using result_type = uint64_t;
+
+  explicit Xoshiro256ss(uint64_t seed) {
+    for (auto & s : m_s)
+      s = splitmix64(seed);
+  };
+  static constexpr result_type min() { return 0; };
+  static constexpr result_type max() { return UINT64_MAX; };
+  result_type operator()() {
+    const uint64_t result = rotl(m_s[1] * 5, 7) * 9;
+    const uint64_t t = m_s[1] << 17;
+    m_s[2] ^= m_s[0];
+    m_s[3] ^= m_s[1];
+    m_s[1] ^= m_s[2];
+    m_s[0] ^= m_s[3];
+    m_s[2] ^= t;
+    m_s[3] = rotl(m_s[3], 45);
+    return result;
+  };
+
+  static uint64_t splitmix64(uint64_t & x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  };
+
+private:
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  };
+  uint64_t m_s[4];
+};
+
+class JitterSource {
+public:
+  enum class Distribution { kNormal, kExponential, kTrace };
+
+  JitterSource(uint64_t seed)
+      : m_seed(seed), m_distribution(Distribution::kNormal){};
+
+  // Configure from "normal", "exponential" or "trace:<file>". A trace file
+  // holds one factor per line: the n-th stage of a thread lasts factor * mean.
+  // Returns false if the specification cannot be used.
+  bool configure(const std::string & spec) {
+    if (spec == "normal") {
+      m_distribution = Distribution::kNormal;
+    } else if (spec == "exponential") {
+      m_distribution = Distribution::kExponential;
+    } else if (spec.compare(0, 6, "trace:") == 0) {
+      m_distribution = Distribution::kTrace;
+      std::ifstream traceFile(spec.substr(6));
+      float factor;
+      while (traceFile >> factor)
+        m_trace.push_back(factor);
+      return !m_trace.empty();
+    } else {
+      return false;
+    }
+    return true;
+  };
+
+  // Every thread calls it once before sampling, with an index which does not
+  // depend on the scheduling, e.g. its rank when it is launched
+  static void bindWorker(size_t worker) { tWorker = worker; };
+
+  // Duration around mean, computed with the generator of the calling thread.
+  // The thread state is static: one JitterSource per program is expected.
+  float sample(float mean) {
+    thread_local ThreadState state(registerThread());
+    switch (m_distribution) {
+    case Distribution::kNormal:
+      return std::fabs(mean + mean * .4f * state.normal(state.generator));
+    case Distribution::kExponential:
+      return mean * state.exponential(state.generator);
+    default:
+      state.traceCursor = (state.traceCursor + 1) % m_trace.size();
+      return mean * m_trace[state.traceCursor];
+    }
+  };
+
+  uint64_t getSeed() const { return m_seed; };
+
+  void printSeeds(std::ostream & os) {
+    std::lock_guard<std::mutex> lock(m_threadSeedsMutex);
+    os << "Jitter seed " << m_seed << ", per worker:\n";
+    for (size_t i = 0; i < m_threadSeeds.size(); ++i)
+      if (m_threadSeeds[i] != 0) // 0 if worker i never sampled
+        os << "  worker " << i << " seed " << m_threadSeeds[i] << "\n";
+  };
+
+private:
+  struct ThreadState {
+    ThreadState(std::pair<size_t, uint64_t> indexAndSeed)
+        : generator(indexAndSeed.second), normal(0.f, 1.f),
+          exponential(1.f), traceCursor(indexAndSeed.first){};
+    Xoshiro256ss generator;
+    std::normal_distribution<float> normal;
+    std::exponential_distribution<float> exponential;
+    size_t traceCursor;
+  };
+
+  // Called once per thread: derive the seed from the worker index
+  std::pair<size_t, uint64_t> registerThread() {
+    if (tWorker == kUnbound) {
+      std::cerr << "JitterSource: sampling from a thread without bindWorker\n";
+      std::abort();
+    }
+    std::lock_guard<std::mutex> lock(m_threadSeedsMutex);
+    uint64_t x = m_seed + tWorker;
+    if (m_threadSeeds.size() <= tWorker)
+      m_threadSeeds.resize(tWorker + 1, 0);
+    m_threadSeeds[tWorker] = Xoshiro256ss::splitmix64(x);
+    return {tWorker, m_threadSeeds[tWorker]};
+  };
+
+  static constexpr size_t kUnbound = SIZE_MAX;
+  static thread_local size_t tWorker;
+
+  const uint64_t m_seed;
+  Distribution m_distribution;
+  std::vector<float> m_trace;
+  std::mutex m_threadSeedsMutex;
+  std::vector<uint64_t> m_threadSeeds;
+};
+
+thread_local size_t JitterSource::tWorker = JitterSource::kUnbound;
+
+//------------------------------------------------------------------------------
+// Per item latency tracing. Every thread appends fixed size events to its own
+// ring buffer: a single writer, no lock, and the oldest events are
+// overwritten when the buffer is full. Once the workers are joined, the
+// buffers are merged into per stage histograms of the queue wait
+// (enqueue -> dequeue) and service time (start -> end), and into a timeline
+// in the Chrome trace format (chrome://tracing or ui.perfetto.dev).
+class Tracer {
+public:
+  enum class EventType : uint8_t { kEnqueue, kDequeue, kStart, kEnd };
+  static constexpr int kNstages = 6;
+  static constexpr const char * kStageNames[kNstages] = {
+      "folding", "stuffing", "sealing", "addressing", "stamping", "mailing"};
+
+  Tracer(size_t maxThreads, size_t eventsPerThread)
+      : m_buffers(maxThreads), m_nBuffers(0), m_capacity(eventsPerThread),
+        m_start(std::chrono::steady_clock::now()){};
+
+  void record(EventType type, size_t item, int stage) {
+    Buffer & buffer = threadBuffer();
+    const size_t head = buffer.head.load(std::memory_order_relaxed);
+    const std::chrono::nanoseconds sinceStart =
+        std::chrono::steady_clock::now() - m_start;
+    buffer.events[head % m_capacity] = {
+        static_cast<uint64_t>(sinceStart.count()), static_cast<uint32_t>(item),
+        static_cast<uint8_t>(stage), type};
+    buffer.head.store(head + 1, std::memory_order_release);
+  };
+
+  // The following methods must be called once the workers are joined
+  void printHistograms(std::ostream & os) const {
+    const int enq = index(EventType::kEnqueue);
+    const int deq = index(EventType::kDequeue);
+    const int start = index(EventType::kStart);
+    const int end = index(EventType::kEnd);
+    Histogram wait[kNstages], service[kNstages];
+    for (auto & span : collectSpans()) {
+      const int stage = span.first % kNstages;
+      const Span & s = span.second;
+      if (s.has[enq] && s.has[deq])
+        wait[stage].fill(s.time[deq] - s.time[enq]);
+      if (s.has[start] && s.has[end])
+        service[stage].fill(s.time[end] - s.time[start]);
+    }
+    os << "Dropped trace events: " << nDropped() << "\n";
+    for (int stage = 0; stage < kNstages; ++stage) {
+      os << "Stage " << kStageNames[stage] << "\n";
+      wait[stage].print(os, "queue wait");
+      service[stage].print(os, "service");
+    }
+  };
+
+  bool writeChromeTrace(const std::string & fileName) const {
+    std::ofstream file(fileName);
+    if (!file.is_open())
+      return false;
+    file << "{\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&first] {
+      const char * sep = first ? "\n" : ",\n";
+      first = false;
+      return sep;
+    };
+    for (auto & span : collectSpans()) {
+      const int stage = span.first % kNstages;
+      const size_t item = span.first / kNstages;
+      const Span & s = span.second;
+      const int enq = index(EventType::kEnqueue);
+      const int deq = index(EventType::kDequeue);
+      const int start = index(EventType::kStart);
+      const int end = index(EventType::kEnd);
+      if (s.has[enq] && s.has[deq]) {
+        file << separator() << "{\"name\":\"wait " << kStageNames[stage]
+             << "\",\"cat\":\"queue\",\"ph\":\"b\",\"id\":" << span.first
+             << ",\"pid\":0,\"tid\":" << s.thread[enq]
+             << ",\"ts\":" << s.time[enq] * 1e-3 << "}";
+        file << separator() << "{\"name\":\"wait " << kStageNames[stage]
+             << "\",\"cat\":\"queue\",\"ph\":\"e\",\"id\":" << span.first
+             << ",\"pid\":0,\"tid\":" << s.thread[deq]
+             << ",\"ts\":" << s.time[deq] * 1e-3 << "}";
+      }
+      if (s.has[start] && s.has[end]) {
+        file << separator() << "{\"name\":\"" << kStageNames[stage]
+             << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":0,\"tid\":"
+             << s.thread[start] << ",\"ts\":" << s.time[start] * 1e-3
+             << ",\"dur\":" << (s.time[end] - s.time[start]) * 1e-3
+             << ",\"args\":{\"item\":" << item << "}}";
+      }
+    }
+    file << "\n]}\n";
+    return true;
+  };
+
+private:
+  struct Event {
+    uint64_t time; // ns since the tracer was created
+    uint32_t item;
+    uint8_t stage;
+    EventType type;
+  };
+
+  struct alignas(64) Buffer {
+    std::vector<Event> events;
+    std::atomic<size_t> head{0};
+  };
+
+  // The four events of one stage of one item
+  struct Span {
+    uint64_t time[4] = {};
+    size_t thread[4] = {};
+    bool has[4] = {};
+  };
+
+  // Power of two buckets, in microseconds
+  struct Histogram {
+    static constexpr int kNbuckets = 40;
+    size_t counts[kNbuckets] = {};
+    size_t n = 0;
+    double sumUs = 0.;
+    double maxUs = 0.;
+    void fill(uint64_t ns) {
+      const double us = ns * 1e-3;
+      int bucket = 0;
+      while (bucket < kNbuckets - 1 && us >= (1ULL << bucket))
+        ++bucket;
+      ++counts[bucket];
+      ++n;
+      sumUs += us;
+      maxUs = std::max(maxUs, us);
+    };
+    // upper edge of the bucket containing the quantile q
+    double quantile(double q) const {
+      size_t cumulated = 0;
+      for (int bucket = 0; bucket < kNbuckets; ++bucket) {
+        cumulated += counts[bucket];
+        if (cumulated >= q * n)
+          return 1ULL << bucket;
+      }
+      return maxUs;
+    };
+    void print(std::ostream & os, const char * name) const {
+      os << "  " << name << " (us): n " << n;
+      if (n == 0) {
+        os << "\n";
+        return;
+      }
+      os << " mean " << sumUs / n << " p50 < " << quantile(.5) << " p99 < "
+         << quantile(.99) << " max " << maxUs << "\n";
+      for (int bucket = 0; bucket < kNbuckets; ++bucket) {
+        if (counts[bucket] == 0)
+          continue;
+        os << "    < " << (1ULL << bucket) << ": " << counts[bucket] << "\n";
+      }
+    };
+  };
+
+  static int index(EventType type) { return static_cast<int>(type); };
+
+  // The buffer of the calling thread, allocated at its first call
+  Buffer & threadBuffer() {
+    thread_local size_t tBuffer = claimBuffer();
+    return m_buffers[tBuffer];
+  };
+  size_t claimBuffer() {
+    std::lock_guard<std::mutex> lock(m_claimMutex);
+    const size_t myBuffer = m_nBuffers.load(std::memory_order_relaxed);
+    if (myBuffer == m_buffers.size()) {
+      std::cerr << "Tracer: more than " << m_buffers.size() << " threads\n";
+      std::abort();
+    }
+    m_buffers[myBuffer].events.resize(m_capacity);
+    m_nBuffers.store(myBuffer + 1, std::memory_order_release);
+    return myBuffer;
+  };
+
+  size_t nDropped() const {
+    size_t dropped = 0;
+    for (size_t b = 0; b < m_nBuffers.load(std::memory_order_acquire); ++b) {
+      const size_t head = m_buffers[b].head.load(std::memory_order_acquire);
+      dropped += head > m_capacity ? head - m_capacity : 0;
+    }
+    return dropped;
+  };
+
+  // Group the retained events by (item, stage)
+  std::map<uint64_t, Span> collectSpans() const {
+    std::map<uint64_t, Span> spans;
+    for (size_t b = 0; b < m_nBuffers.load(std::memory_order_acquire); ++b) {
+      const Buffer & buffer = m_buffers[b];
+      const size_t head = buffer.head.load(std::memory_order_acquire);
+      for (size_t i = head > m_capacity ? head - m_capacity : 0; i < head;
+           ++i) {
+        const Event & event = buffer.events[i % m_capacity];
+        Span & span = spans[uint64_t(event.item) * kNstages + event.stage];
+        span.time[index(event.type)] = event.time;
+        span.thread[index(event.type)] = b;
+        span.has[index(event.type)] = true;
+      }
+    }
+    return spans;
+  };
+
+  std::vector<Buffer> m_buffers;
+  std::atomic<size_t> m_nBuffers;
+  std::mutex m_claimMutex;
+  const size_t m_capacity;
+  const std::chrono::steady_clock::time_point m_start;
+};
+
+//------------------------------------------------------------------------------
+// All the stage durations are multiplied by the MAIL_TIME_SCALE environment
+// variable (default 1), e.g. to benchmark with stages lasting microseconds
+float timeScale() {
+  static const float scale = [] {
+    const char * value = std::getenv("MAIL_TIME_SCALE");
+    return value ? std::stof(value) : 1.f;
+  }();
+  return scale;
+}
+
 //------------------------------------------------------------------------------
 // Small dummy class representing a mail item.
 // It has an Id, a state, and knows about its transitions
@@ -106,12 +473,20 @@ public:
     kMailed
   };
 
-  MailItem() : m_id(0), m_state(State::kStart), m_monitor(nullptr){};
+  MailItem()
+      : m_id(0), m_state(State::kStart), m_monitor(nullptr),
+        m_jitter(nullptr), m_tracer(nullptr){};
 
-  MailItem(size_t id, MailMonitor * monitor)
-      : m_id(id), m_state(State::kStart), m_monitor(monitor){};
+  MailItem(size_t id, MailMonitor * monitor, JitterSource * jitter,
+           Tracer * tracer)
+      : m_id(id), m_state(State::kStart), m_monitor(monitor),
+        m_jitter(jitter), m_tracer(tracer){};
   size_t getId() { return m_id; };
   State getState() { return m_state; };
+  // Record an event for the next stage of this item
+  void trace(Tracer::EventType type) {
+    m_tracer->record(type, m_id, static_cast<int>(m_state));
+  };
   // Method to go through the mail state machine
   // returns false once finished
   bool next() {
@@ -143,116 +518,462 @@ private:
   size_t m_id;
   State m_state;
   MailMonitor * m_monitor;
-  void doWork(const State & newState, const std::string & action,
+  JitterSource * m_jitter;
+  Tracer * m_tracer;
+  void doWork(const State & newState, const char * action,
               const float deltaTf);
 };
 
 //------------------------------------------------------------------------------
-class MailMonitor {
+// What the monitor knows at a given time. Sinks receive one snapshot per
+// monitoring period and render or export it.
+struct MonitorSnapshot {
+  static constexpr int kNstates =
+      static_cast<int>(MailItem::State::kMailed) + 1;
+  static constexpr const char * kStateNames[kNstates] = {
+      "Start", "Folded", "Stuffed", "Sealed", "Addressed", "Stamped", "Mailed"};
+
+  double time = 0.;       // seconds since the monitor was created
+  double throughput = 0.; // mailed items per second since the last snapshot
+  int stateCounter[kNstates] = {};
+  std::vector<int> actionCounter;        // per worker
+  std::vector<const char *> workerAction; // per worker, "" if idle
+  std::vector<std::pair<const char *, size_t>> queueDepth;
+};
+
+//------------------------------------------------------------------------------
+// Interface of the monitor outputs
+class MonitorSink {
+public:
+  virtual ~MonitorSink(){};
+  virtual void write(const MonitorSnapshot & snapshot) = 0;
+  virtual void finalize(){};
+  // Time to wait before the next snapshot
+  virtual std::chrono::milliseconds period() {
+    return std::chrono::milliseconds(50);
+  };
+};
+
+// The animated view in the terminal. The last frame shown is kept, and only
+// the cells which differ in the new one are sent to curses. The bars are
+// scaled to fit in the terminal, linearly (a power of 2 items per cell) or
+// logarithmically, and the refresh period grows while nothing changes.
+class CursesSink : public MonitorSink {
 public:
-  MailMonitor() {
-    // initialize the stateCounter to zero everywhere
-    m_stateCounter[MailItem::State::kStart] = 0;
-    m_stateCounter[MailItem::State::kFolded] = 0;
-    m_stateCounter[MailItem::State::kStuffed] = 0;
-    m_stateCounter[MailItem::State::kSealed] = 0;
-    m_stateCounter[MailItem::State::kAddressed] = 0;
-    m_stateCounter[MailItem::State::kStamped] = 0;
-    m_stateCounter[MailItem::State::kMailed] = 0;
+  CursesSink(bool logScale)
+      : m_logScale(logScale), m_rows(0), m_cols(0), m_period(kBasePeriod),
+        m_minPeriod(kBasePeriod), m_maxPeriod(kBasePeriod), m_nFrames(0),
+        m_nCells(0), m_totalCost(0.), m_maxCost(0.), m_lastCost(0.),
+        m_lastCells(0) {
     initscr();
     clear();
   };
-  virtual ~MailMonitor(){};
+  void write(const MonitorSnapshot & snapshot) override {
+    auto start = std::chrono::steady_clock::now();
+    if (LINES != m_rows || COLS != m_cols) {
+      // new terminal size: start again from a blank screen
+      m_rows = LINES;
+      m_cols = COLS;
+      m_shown.assign(m_rows * m_cols, ' ');
+      clear();
+    }
+    m_frame.assign(m_rows * m_cols, ' ');
+    compose(snapshot);
 
-  void add(MailItem::State state) { m_stateCounter[state]++; };
-  void finalize() { endwin(); };
-  void register_worker(std::thread::id thread) {
-    m_workerAction[thread] = "";
-    m_actionCounter[thread] = 0;
-  }
-  void remove(MailItem::State state) { m_stateCounter[state]--; };
-  // The two following methods are in principle not thread safe. Why isn't that
-  // a problem here?
-  void worker_busy(std::thread::id thread, std::string action) {
-    m_workerAction[thread] = action;
-    ++m_actionCounter[thread];
-  };
-  void worker_free(std::thread::id thread) { m_workerAction[thread] = ""; };
-  void update() {
-    clear();
-    // display all queues
+    int nChanged = 0;
+    int nStatusChanged = 0;
+    for (int r = 0; r < m_rows; ++r) {
+      for (int c = 0; c < m_cols; ++c) {
+        const size_t i = r * m_cols + c;
+        // writing the last cell would scroll the screen
+        if (m_frame[i] == m_shown[i] || i + 1 == m_frame.size())
+          continue;
+        mvaddch(r, c, m_frame[i]);
+        m_shown[i] = m_frame[i];
+        ++nChanged;
+        nStatusChanged += r == 0;
+      }
+    }
+    move(0, 0);
+    refresh();
+
+    std::chrono::duration<double, std::micro> cost =
+        std::chrono::steady_clock::now() - start;
+    m_lastCost = cost.count();
+    m_lastCells = nChanged;
+    m_totalCost += m_lastCost;
+    m_maxCost = std::max(m_maxCost, m_lastCost);
+    m_nCells += nChanged;
+    ++m_nFrames;
+    adaptPeriod(nChanged - nStatusChanged);
+  };
+  std::chrono::milliseconds period() override { return m_period; };
+  void finalize() override {
+    endwin();
+    if (m_nFrames == 0)
+      return;
+    std::cout << "Monitor: " << m_nFrames << " frames, "
+              << m_totalCost / m_nFrames << " us per frame (max " << m_maxCost
+              << " us), " << double(m_nCells) / m_nFrames
+              << " cells redrawn per frame, refresh every "
+              << m_minPeriod.count() << " to " << m_maxPeriod.count()
+              << " ms\n";
+  };
+
+private:
+  static constexpr std::chrono::milliseconds kBasePeriod{50};
+  static constexpr std::chrono::milliseconds kMinPeriod{20};
+  static constexpr std::chrono::milliseconds kMaxPeriod{400};
+
+  // Draw the snapshot in m_frame
+  void compose(const MonitorSnapshot & snapshot) {
     const int x_offset(2);
-    move(1, x_offset);
-    printw("%10s :", "Start");
-    mvhline(1, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kStart]);
-    move(2, x_offset);
-    printw("%10s :", "Folded");
-    mvhline(2, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kFolded]);
-    move(3, x_offset);
-    printw("%10s :", "Stuffed");
-    mvhline(3, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kStuffed]);
-    move(4, x_offset);
-    printw("%10s :", "Sealed");
-    mvhline(4, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kSealed]);
-    move(5, x_offset);
-    printw("%10s :", "Addressed");
-    mvhline(5, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kAddressed]);
-    move(6, x_offset);
-    printw("%10s :", "Stamped");
-    mvhline(6, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kStamped]);
-    move(7, x_offset);
-    printw("%10s :", "Mailed");
-    mvhline(7, x_offset + 14, ACS_BOARD,
-            m_stateCounter[MailItem::State::kMailed]);
+    // display all queues
+    int nItems = 0;
+    for (int count : snapshot.stateCounter)
+      nItems += count;
+    const int stateWidth = m_cols - (x_offset + 24) - 1;
+    for (int s = 0; s < MonitorSnapshot::kNstates; ++s) {
+      putText(1 + s, x_offset, "%10s %9d :",
+              MonitorSnapshot::kStateNames[s], snapshot.stateCounter[s]);
+      putBar(1 + s, x_offset + 24, ACS_BOARD,
+             barLength(snapshot.stateCounter[s], nItems, stateWidth));
+    }
     // display all workers
-    int index(0);
-    move(9, x_offset);
-    printw("%12s  %10s    %s", "Thread ID", "Action", "Performed actions");
-    for (auto action : m_workerAction) {
-      move(11 + index, x_offset);
-      printw("%12u  %10s", action.first, action.second.c_str());
-      ++index;
+    int maxActions = 0;
+    for (int count : snapshot.actionCounter)
+      maxActions = std::max(maxActions, count);
+    const int workerWidth = m_cols - (x_offset + 28) - 1;
+    putText(9, x_offset, "%12s  %10s    %s", "Worker", "Action",
+            "Performed actions");
+    for (size_t i = 0; i < snapshot.actionCounter.size(); ++i) {
+      putText(11 + i, x_offset, "%12zu  %10s", i, snapshot.workerAction[i]);
+      putBar(11 + i, x_offset + 28, ACS_DIAMOND,
+             barLength(snapshot.actionCounter[i], maxActions, workerWidth));
     }
-    index = 0;
-    for (auto & counter : m_actionCounter) {
-      mvhline(11 + index, x_offset + 28, ACS_DIAMOND, counter.second);
-      ++index;
+    putText(0, x_offset, "%s | frame %d: %d cells, %.0f us | every %d ms",
+            m_logScale ? "log scale" : "linear scale", m_nFrames,
+            m_lastCells, m_lastCost, int(m_period.count()));
+  };
+
+  // Cells of a bar of 'count' when 'max' has to fit in 'width'
+  int barLength(int count, int max, int width) {
+    if (count <= 0 || width <= 0)
+      return 0;
+    if (m_logScale)
+      return std::lround(width * std::log2(1. + count) /
+                         std::log2(1. + std::max(max, width)));
+    int itemsPerCell = 1;
+    while (max > itemsPerCell * width)
+      itemsPerCell *= 2; // a stable scale: it changes rarely
+    return (count + itemsPerCell - 1) / itemsPerCell;
+  };
+
+  template <class... Args>
+  void putText(int row, int col, const char * format, Args... args) {
+    char text[256];
+    std::snprintf(text, sizeof(text), format, args...);
+    for (int i = 0; text[i] && row < m_rows && col + i < m_cols; ++i)
+      m_frame[row * m_cols + col + i] = text[i];
+  }
+
+  void putBar(int row, int col, chtype cell, int length) {
+    for (int i = 0; i < length && row < m_rows && col + i < m_cols; ++i)
+      m_frame[row * m_cols + col + i] = cell;
+  };
+
+  // Twice slower when nothing moved, twice faster when much did
+  void adaptPeriod(int nChanged) {
+    if (nChanged == 0)
+      m_period = std::min(kMaxPeriod, m_period * 2);
+    else if (nChanged > m_cols)
+      m_period = std::max(kMinPeriod, m_period / 2);
+    m_minPeriod = std::min(m_minPeriod, m_period);
+    m_maxPeriod = std::max(m_maxPeriod, m_period);
+  };
+
+  const bool m_logScale;
+  int m_rows;
+  int m_cols;
+  std::vector<chtype> m_frame; // being composed
+  std::vector<chtype> m_shown; // on the screen
+  std::chrono::milliseconds m_period;
+  std::chrono::milliseconds m_minPeriod;
+  std::chrono::milliseconds m_maxPeriod;
+  int m_nFrames;
+  long m_nCells;
+  double m_totalCost; // us
+  double m_maxCost;
+  double m_lastCost;
+  int m_lastCells;
+};
+
+// One line per snapshot, either CSV (with a header) or JSON lines
+class TimeSeriesSink : public MonitorSink {
+public:
+  TimeSeriesSink(const std::string & fileName, bool json)
+      : m_file(fileName), m_json(json), m_headerDone(false){};
+  bool isOpen() const { return m_file.is_open(); };
+  void write(const MonitorSnapshot & snapshot) override {
+    if (m_json)
+      writeJson(snapshot);
+    else
+      writeCsv(snapshot);
+  };
+  void finalize() override { m_file.flush(); };
+
+private:
+  void writeCsv(const MonitorSnapshot & snapshot) {
+    if (!m_headerDone) {
+      m_file << "time,throughput";
+      for (auto name : MonitorSnapshot::kStateNames)
+        m_file << "," << name;
+      for (auto & queue : snapshot.queueDepth)
+        m_file << ",queue_" << queue.first;
+      for (size_t i = 0; i < snapshot.actionCounter.size(); ++i)
+        m_file << ",worker_" << i;
+      m_file << "\n";
+      m_headerDone = true;
     }
-    move(0, 0);
-    refresh();
+    m_file << snapshot.time << "," << snapshot.throughput;
+    for (auto count : snapshot.stateCounter)
+      m_file << "," << count;
+    for (auto & queue : snapshot.queueDepth)
+      m_file << "," << queue.second;
+    for (auto count : snapshot.actionCounter)
+      m_file << "," << count;
+    m_file << "\n";
+  };
+  void writeJson(const MonitorSnapshot & snapshot) {
+    m_file << "{\"time\":" << snapshot.time
+           << ",\"throughput\":" << snapshot.throughput << ",\"states\":{";
+    for (int s = 0; s < MonitorSnapshot::kNstates; ++s)
+      m_file << (s ? "," : "") << "\"" << MonitorSnapshot::kStateNames[s]
+             << "\":" << snapshot.stateCounter[s];
+    m_file << "},\"queues\":{";
+    for (size_t q = 0; q < snapshot.queueDepth.size(); ++q)
+      m_file << (q ? "," : "") << "\"" << snapshot.queueDepth[q].first
+             << "\":" << snapshot.queueDepth[q].second;
+    m_file << "},\"workers\":[";
+    for (size_t i = 0; i < snapshot.actionCounter.size(); ++i)
+      m_file << (i ? "," : "") << "{\"actions\":" << snapshot.actionCounter[i]
+             << ",\"current\":\"" << snapshot.workerAction[i] << "\"}";
+    m_file << "]}\n";
+  };
+
+  std::ofstream m_file;
+  const bool m_json;
+  bool m_headerDone;
+};
+
+// The last snapshot in the Prometheus text format, e.g. for the textfile
+// collector of the node exporter. The file is replaced atomically.
+class PrometheusSink : public MonitorSink {
+public:
+  PrometheusSink(const std::string & fileName) : m_fileName(fileName){};
+  void write(const MonitorSnapshot & snapshot) override {
+    const std::string tmpName = m_fileName + ".tmp";
+    std::ofstream file(tmpName);
+    if (!file) {
+      reportError("cannot open " + tmpName);
+      return;
+    }
+    file << "# HELP mail_items Number of mail items in each state.\n"
+         << "# TYPE mail_items gauge\n";
+    for (int s = 0; s < MonitorSnapshot::kNstates; ++s)
+      file << "mail_items{state=\"" << MonitorSnapshot::kStateNames[s]
+           << "\"} " << snapshot.stateCounter[s] << "\n";
+    file << "# HELP mail_queue_depth Number of entries in each queue.\n"
+         << "# TYPE mail_queue_depth gauge\n";
+    for (auto & queue : snapshot.queueDepth)
+      file << "mail_queue_depth{queue=\"" << queue.first << "\"} "
+           << queue.second << "\n";
+    file << "# HELP mail_worker_actions_total Actions performed by worker.\n"
+         << "# TYPE mail_worker_actions_total counter\n";
+    for (size_t i = 0; i < snapshot.actionCounter.size(); ++i)
+      file << "mail_worker_actions_total{worker=\"" << i << "\"} "
+           << snapshot.actionCounter[i] << "\n";
+    file << "# HELP mail_throughput Items mailed per second.\n"
+         << "# TYPE mail_throughput gauge\n"
+         << "mail_throughput " << snapshot.throughput << "\n"
+         << "# HELP mail_monitor_time_seconds Time since start.\n"
+         << "# TYPE mail_monitor_time_seconds gauge\n"
+         << "mail_monitor_time_seconds " << snapshot.time << "\n";
+    file.close();
+    // a short write must not replace the last complete file
+    if (!file) {
+      reportError("cannot write " + tmpName);
+      std::remove(tmpName.c_str());
+      return;
+    }
+    if (std::rename(tmpName.c_str(), m_fileName.c_str()) != 0)
+      reportError("cannot rename " + tmpName + " to " + m_fileName);
   };
 
 private:
-  std::map<std::thread::id, std::string> m_workerAction;
-  std::map<MailItem::State, std::atomic<int>> m_stateCounter;
-  std::map<std::thread::id, std::atomic<int>> m_actionCounter;
+  // Once: the monitor writes every period, and the cause seldom goes away
+  void reportError(const std::string & what) {
+    if (m_errorReported)
+      return;
+    std::cerr << "PrometheusSink: " << what << ", metrics not published\n";
+    m_errorReported = true;
+  };
+
+  const std::string m_fileName;
+  bool m_errorReported = false;
+};
+
+// Build a sink from "curses", "curses:log", "csv:<file>", "jsonl:<file>" or
+// "prom:<file>". Returns nullptr if the specification cannot be used.
+std::unique_ptr<MonitorSink> makeMonitorSink(const std::string & spec) {
+  if (spec == "curses" || spec == "curses:log")
+    return std::make_unique<CursesSink>(spec == "curses:log");
+  const size_t colon = spec.find(':');
+  if (colon == std::string::npos)
+    return nullptr;
+  const std::string kind = spec.substr(0, colon);
+  const std::string fileName = spec.substr(colon + 1);
+  if (kind == "csv" || kind == "jsonl") {
+    auto sink = std::make_unique<TimeSeriesSink>(fileName, kind == "jsonl");
+    if (sink->isOpen())
+      return sink;
+  } else if (kind == "prom") {
+    return std::make_unique<PrometheusSink>(fileName);
+  }
+  return nullptr;
+}
+
+//------------------------------------------------------------------------------
+// The monitor is written to at every stage transition by every worker, so it
+// must be cheap: each thread owns a slot on its own cache line, found through
+// a thread_local dense index, and only updates its own relaxed counters. The
+// per state totals are computed on the reader side, in update(), and handed
+// to the sink.
+class MailMonitor {
+public:
+  static constexpr int kNstates = MonitorSnapshot::kNstates;
+
+  MailMonitor(size_t maxWorkers, MonitorSink * sink)
+      : m_slots(maxWorkers), m_nSlots(0), m_sink(sink),
+        m_start(std::chrono::steady_clock::now()), m_lastTime(0.),
+        m_lastMailed(0){};
+  virtual ~MailMonitor(){};
+
+  void add(MailItem::State state) {
+    increment(slot().stateDelta[index(state)]);
+  };
+  // Push the final state to the sink and close it
+  void finalize() {
+    update();
+    m_sink->finalize();
+  };
+  // Queues whose depth is reported at every update
+  void register_queue(const char * name, std::function<size_t()> depth) {
+    m_queues.emplace_back(name, depth);
+  };
+  void remove(MailItem::State state) {
+    decrement(slot().stateDelta[index(state)]);
+  };
+  // action must be a string literal: only the pointer is stored
+  void worker_busy(const char * action) {
+    Slot & mySlot = slot();
+    mySlot.action.store(action, std::memory_order_relaxed);
+    increment(mySlot.actionCounter);
+  };
+  void worker_free() { slot().action.store("", std::memory_order_relaxed); };
+  // Time to wait before the next update, chosen by the sink
+  std::chrono::milliseconds period() { return m_sink->period(); };
+  void update() {
+    MonitorSnapshot snapshot;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - m_start;
+    snapshot.time = elapsed.count();
+    // aggregate the per thread counters
+    const size_t nSlots = m_nSlots.load(std::memory_order_acquire);
+    snapshot.actionCounter.assign(m_slots.size(), 0);
+    snapshot.workerAction.assign(m_slots.size(), "");
+    for (size_t i = 0; i < nSlots; ++i) {
+      const Slot & aSlot = m_slots[i];
+      for (int s = 0; s < kNstates; ++s)
+        snapshot.stateCounter[s] +=
+            aSlot.stateDelta[s].load(std::memory_order_relaxed);
+      snapshot.actionCounter[i] =
+          aSlot.actionCounter.load(std::memory_order_relaxed);
+      snapshot.workerAction[i] = aSlot.action.load(std::memory_order_relaxed);
+    }
+    for (auto & queue : m_queues)
+      snapshot.queueDepth.emplace_back(queue.first, queue.second());
+    const int mailed = snapshot.stateCounter[kNstates - 1];
+    if (snapshot.time > m_lastTime)
+      snapshot.throughput =
+          (mailed - m_lastMailed) / (snapshot.time - m_lastTime);
+    m_lastTime = snapshot.time;
+    m_lastMailed = mailed;
+    m_sink->write(snapshot);
+  };
+
+private:
+  struct alignas(64) Slot {
+    std::atomic<int> stateDelta[kNstates] = {};
+    std::atomic<int> actionCounter{0};
+    std::atomic<const char *> action{""};
+  };
+
+  static int index(MailItem::State state) { return static_cast<int>(state); };
+  // Only the owner thread writes a slot: no read-modify-write needed
+  static void increment(std::atomic<int> & counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  };
+  static void decrement(std::atomic<int> & counter) {
+    counter.store(counter.load(std::memory_order_relaxed) - 1,
+                  std::memory_order_relaxed);
+  };
+
+  // The slot of the calling thread, claimed at its first call
+  Slot & slot() {
+    thread_local size_t tSlot = claimSlot();
+    return m_slots[tSlot];
+  };
+  size_t claimSlot() {
+    std::lock_guard<std::mutex> lock(m_claimMutex);
+    const size_t mySlot = m_nSlots.load(std::memory_order_relaxed);
+    if (mySlot == m_slots.size()) {
+      std::cerr << "MailMonitor: more than " << m_slots.size()
+                << " threads\n";
+      std::abort();
+    }
+    m_nSlots.store(mySlot + 1, std::memory_order_release);
+    return mySlot;
+  };
+
+  std::vector<Slot> m_slots;
+  std::atomic<size_t> m_nSlots;
+  std::mutex m_claimMutex;
+  MonitorSink * m_sink;
+  std::vector<std::pair<const char *, std::function<size_t()>>> m_queues;
+  // only used by the thread calling update()
+  const std::chrono::steady_clock::time_point m_start;
+  double m_lastTime;
+  int m_lastMailed;
 };
 
 //------------------------------------------------------------------------------
 // Implementation for MailItem::doWork has to be after full declaration of
 // MailMonitor
-void MailItem::doWork(const State & newState, const std::string & action,
+void MailItem::doWork(const State & newState, const char * action,
                       const float deltaTf) {
-  m_monitor->worker_busy(std::this_thread::get_id(), action);
+  m_monitor->worker_busy(action);
   // spend some time doing 'work'
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::normal_distribution<> d(deltaTf, deltaTf * .4);
-  Duration deltaT(std::fabs(d(gen)));
-  Duration elapsed_seconds;
-  TimePoint start, end;
+  Duration deltaT(m_jitter->sample(deltaTf * timeScale()));
+  trace(Tracer::EventType::kStart);
   std::this_thread::sleep_for(deltaT);
+  trace(Tracer::EventType::kEnd);
   // update state and notify monitor object
   m_monitor->remove(m_state);
   m_state = newState;
   m_monitor->add(m_state);
-  m_monitor->worker_free(std::this_thread::get_id());
+  m_monitor->worker_free();
 };
 
 //------------------------------------------------------------------------------
@@ -279,17 +1000,18 @@ void pullWork(TsActionPtrQueue * workQueue, std::function<bool()> stopCondition,
 void doMonitor(MailMonitor * monitor, std::function<bool()> stopCondition) {
   while (stopCondition()) {
     monitor->update();
-    std::chrono::milliseconds sleepDuration(50);
-    std::this_thread::sleep_for(sleepDuration);
+    std::this_thread::sleep_for(monitor->period());
   }
 }
 
 //------------------------------------------------------------------------------
 void doMail(MailItem & item, TsActionPtrQueue * p_actionsQueue,
             TsQueue<MailItem> * p_sentMailItemsQueue) {
+  item.trace(Tracer::EventType::kDequeue);
   if (item.next()) {
     Action * work = new Action(
         std::bind(doMail, item, p_actionsQueue, p_sentMailItemsQueue));
+    item.trace(Tracer::EventType::kEnqueue);
     p_actionsQueue->push(work);
   } else {
     p_sentMailItemsQueue->push(item);
@@ -301,15 +1023,22 @@ int main(int argc, char ** argv) {
 
   // Get the arguments from command line and notify start
   // Parse args
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <mail items> <n working threads>\n";
+  if (argc < 3 || argc > 7) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads>"
+                 " [normal|exponential|trace:<file>] [seed]"
+                 " [curses|curses:log|csv:<file>|jsonl:<file>|prom:<file>]"
+                 " [chrome trace file]\n";
     return 1;
   }
 
   int nItems = std::stoi(argv[1]);
   int nThreads = std::stoi(argv[2]);
+  JitterSource jitter(argc > 4 ? std::stoull(argv[4])
+                               : std::random_device()());
 
-  if (nItems * nThreads == 0) {
+  if (nItems * nThreads == 0 ||
+      !jitter.configure(argc > 3 ? argv[3] : "normal")) {
     std::cerr << "Invalid input parameter(s) value(s)\n";
     return 1;
   }
@@ -317,9 +1046,23 @@ int main(int argc, char ** argv) {
   std::cout << "Starting with " << nItems << " items and " << nThreads
             << " threads\n";
   //-------------------------------------------------------
-  MailMonitor monitor;
-  auto actionsQueue = TsActionPtrQueue(1000);
+  std::unique_ptr<MonitorSink> monitorSink =
+      makeMonitorSink(argc > 5 ? argv[5] : "curses");
+  if (!monitorSink) {
+    std::cerr << "Invalid monitor output " << argv[5] << "\n";
+    return 1;
+  }
+  MailMonitor monitor(nThreads, monitorSink.get());
+  Tracer tracer(nThreads, 1 << 18);
+  // An item has at most one action queued: with room for all of them, a
+  // worker never blocks pushing the next stage while the pump fills the queue
+  auto actionsQueue = TsActionPtrQueue(nItems);
   auto sentMailItemsQueue = TsQueue<MailItem>(nItems);
+  monitor.register_queue("actions",
+                         [&actionsQueue] { return actionsQueue.getNitems(); });
+  monitor.register_queue("sent", [&sentMailItemsQueue] {
+    return sentMailItemsQueue.getNitems();
+  });
 
   // Here the real orchestration starts!
 
@@ -334,21 +1077,22 @@ int main(int argc, char ** argv) {
   auto stopPullingWork(
       [&sentMailItemsQueue] { return !sentMailItemsQueue.isFull(); });
 
+  auto start = std::chrono::steady_clock::now();
+
   // Launch worker threads
   std::vector<std::thread> workerThreads;
   for (int i = 0; i < nThreads - 1; ++i) { // 1 thread is the main thread :)
-    workerThreads.emplace_back(pullWork, &actionsQueue, stopPullingWork, false);
-  }
-  // register the worker threads to the monitor
-  for (auto & worker : workerThreads) {
-    monitor.register_worker(worker.get_id());
+    workerThreads.emplace_back([&actionsQueue, stopPullingWork, i] {
+      JitterSource::bindWorker(i + 1);
+      pullWork(&actionsQueue, stopPullingWork, false);
+    });
   }
 
   // Create the mail items (this thread owns them)
   std::vector<MailItem> MailItems;
   MailItems.reserve(nItems);
   for (int i = 0; i < nItems; ++i) {
-    MailItems.emplace_back(i, &monitor);
+    MailItems.emplace_back(i, &monitor, &jitter, &tracer);
     monitor.add(MailItem::State::kStart);
   }
   // Pump the work into the work queue
@@ -356,20 +1100,35 @@ int main(int argc, char ** argv) {
   for (auto & MailItem : MailItems) {
     action = new Action(
         std::bind(doMail, MailItem, &actionsQueue, &sentMailItemsQueue));
+    MailItem.trace(Tracer::EventType::kEnqueue);
     actionsQueue.push(action);
   }
 
   // transform the main thread in a worker
+  JitterSource::bindWorker(0);
   pullWork(&actionsQueue, stopPullingWork, false);
 
   // Join threads
   for (auto & thr : workerThreads) // 1 thread is the main thread :)
     thr.join();
 
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
   // no more work, let's join the logger thread
   workEnded = true;
   displaSvcThr.join();
   monitor.finalize();
 
-  std::cout << "Work finished, threads joined\n";
+  std::cout << "Work finished, threads joined\n"
+            << "Elapsed time: " << elapsed.count() << " s, throughput "
+            << nItems / elapsed.count() << " items/s\n";
+  jitter.printSeeds(std::cout);
+  tracer.printHistograms(std::cout);
+  if (argc > 6) {
+    if (tracer.writeChromeTrace(argv[6]))
+      std::cout << "Timeline written to " << argv[6] << "\n";
+    else
+      std::cerr << "Cannot write " << argv[6] << "\n";
+  }
 }
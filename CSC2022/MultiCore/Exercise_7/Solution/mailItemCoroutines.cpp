@@ -0,0 +1,403 @@
+/* Mail item processing with C++20 coroutines
+g++ mailItemCoroutines.cpp -o mailItemCoroutines -std=c++20 -fgnu-tm -pthread
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemCoroutines <mail items> <n working threads> [time scale]
+
+In mailItemBetterDesign every stage ends by binding the next one and queuing
+it as a new Action: continuation passing style written by hand. Here every
+mail item is a single coroutine which goes through the stages in a plain
+loop, and co_awaits the scheduler between two stages. The coroutine frames
+come from a pool, so no std::bind copy and no new Action per stage, and the
+frames allocated are only the peak of items in flight: the others are reused.
+The same items are also processed with the callback design, and tasks per
+second and memory per in-flight item are printed for both.
+The stage durations are multiplied by the time scale (default 1): with 0 the
+stages are empty and the scheduling overhead alone is measured.
+*/
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Action = std::function<void()>;
+using Duration = std::chrono::duration<float>;
+
+//------------------------------------------------------------------------------
+// Small dummy class representing a mail item.
+class MailItem {
+public:
+  enum class State : char {
+    kStart,
+    kFolded,
+    kStuffed,
+    kSealed,
+    kAddressed,
+    kStamped,
+    kMailed
+  };
+
+  MailItem() : m_id(0), m_state(State::kStart){};
+  MailItem(size_t id) : m_id(id), m_state(State::kStart){};
+  size_t getId() { return m_id; };
+  State getState() { return m_state; };
+  // Go through one step of the mail state machine, returns false once mailed
+  bool next(float timeScale) {
+    switch (m_state) {
+    case State::kStart:
+      doWork(State::kFolded, 0.12 * timeScale);
+      return true;
+    case State::kFolded:
+      doWork(State::kStuffed, 0.1 * timeScale);
+      return true;
+    case State::kStuffed:
+      doWork(State::kSealed, 0.24 * timeScale);
+      return true;
+    case State::kSealed:
+      doWork(State::kAddressed, 0.5 * timeScale);
+      return true;
+    case State::kAddressed:
+      doWork(State::kStamped, 0.05 * timeScale);
+      return true;
+    case State::kStamped:
+      doWork(State::kMailed, 0.7 * timeScale);
+      return false;
+    default:
+      return false;
+    }
+  };
+
+private:
+  size_t m_id;
+  State m_state;
+  void doWork(State newState, float deltaTf) {
+    if (deltaTf > 0.f)
+      std::this_thread::sleep_for(Duration(deltaTf));
+    m_state = newState;
+  };
+};
+
+//------------------------------------------------------------------------------
+// Pool for the coroutine frames. Blocks are recycled in size classes of 64
+// bytes through free lists shared by all the threads: the frames are created
+// by the pump but destroyed by the workers, so per thread lists would never
+// give a block back to the thread which needs it.
+class FramePool {
+public:
+  static void * allocate(size_t size) {
+    const size_t sizeClass = (size + kGranularity - 1) / kGranularity;
+    updateMax(s_maxFrameSize, size);
+    if (sizeClass >= kNclasses)
+      return ::operator new(size);
+    FreeList & freeList = s_freeLists[sizeClass];
+    {
+      std::lock_guard<std::mutex> lock(freeList.mutex);
+      if (!freeList.blocks.empty()) {
+        void * block = freeList.blocks.back();
+        freeList.blocks.pop_back();
+        s_blocksReused.fetch_add(1, std::memory_order_relaxed);
+        return block;
+      }
+    }
+    s_blocksAllocated.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(sizeClass * kGranularity);
+  };
+
+  static void deallocate(void * block, size_t size) {
+    const size_t sizeClass = (size + kGranularity - 1) / kGranularity;
+    if (sizeClass >= kNclasses) {
+      ::operator delete(block);
+      return;
+    }
+    FreeList & freeList = s_freeLists[sizeClass];
+    std::lock_guard<std::mutex> lock(freeList.mutex);
+    freeList.blocks.push_back(block);
+  };
+
+  static size_t getMaxFrameSize() { return s_maxFrameSize.load(); };
+  static size_t getBlocksAllocated() { return s_blocksAllocated.load(); };
+  static size_t getBlocksReused() { return s_blocksReused.load(); };
+
+private:
+  static constexpr size_t kGranularity = 64;
+  static constexpr size_t kNclasses = 16;
+
+  // The blocks are given back to the system at exit
+  struct alignas(64) FreeList {
+    ~FreeList() {
+      for (void * block : blocks)
+        ::operator delete(block);
+    };
+    std::mutex mutex;
+    std::vector<void *> blocks;
+  };
+
+  static void updateMax(std::atomic<size_t> & max, size_t value) {
+    size_t current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value))
+      ;
+  };
+
+  static FreeList s_freeLists[kNclasses];
+  static std::atomic<size_t> s_maxFrameSize;
+  static std::atomic<size_t> s_blocksAllocated;
+  static std::atomic<size_t> s_blocksReused;
+};
+
+FramePool::FreeList FramePool::s_freeLists[kNclasses];
+std::atomic<size_t> FramePool::s_maxFrameSize{0};
+std::atomic<size_t> FramePool::s_blocksAllocated{0};
+std::atomic<size_t> FramePool::s_blocksReused{0};
+
+//------------------------------------------------------------------------------
+// The scheduler is just the work queue of suspended coroutines. Awaiting
+// schedule() suspends the coroutine and puts it in the queue: one of the
+// workers will resume it.
+class Scheduler {
+public:
+  Scheduler(size_t queueSize) : m_queue(queueSize){};
+
+  struct ScheduleAwaiter {
+    Scheduler * scheduler;
+    bool await_ready() const noexcept { return false; };
+    void await_suspend(std::coroutine_handle<> handle) {
+      scheduler->m_queue.push(handle.address());
+    };
+    void await_resume() const noexcept {};
+  };
+
+  ScheduleAwaiter schedule() { return {this}; };
+
+  // Resume one coroutine if any is ready, returns false otherwise
+  bool runOne() {
+    void * address = nullptr;
+    if (!m_queue.try_pop(address))
+      return false;
+    std::coroutine_handle<>::from_address(address).resume();
+    return true;
+  };
+
+private:
+  // the addresses of the handles: plain pointers are safe in a transaction
+  TsQueue<void *> m_queue;
+};
+
+//------------------------------------------------------------------------------
+// Return type of the mail coroutine. Nobody waits for it: the coroutine
+// starts immediately and its frame is destroyed when it finishes.
+struct MailTask {
+  struct promise_type {
+    MailTask get_return_object() { return {}; };
+    std::suspend_never initial_suspend() noexcept { return {}; };
+    std::suspend_never final_suspend() noexcept { return {}; };
+    void return_void(){};
+    void unhandled_exception() { std::terminate(); };
+
+    static void * operator new(size_t size) {
+      return FramePool::allocate(size);
+    };
+    static void operator delete(void * frame, size_t size) {
+      FramePool::deallocate(frame, size);
+    };
+  };
+};
+
+//------------------------------------------------------------------------------
+// The whole life of a mail item
+MailTask processMail(MailItem item, Scheduler & scheduler, float timeScale,
+                     std::atomic<size_t> & nMailed) {
+  bool notMailed = true;
+  while (notMailed) {
+    co_await scheduler.schedule();
+    notMailed = item.next(timeScale);
+  }
+  nMailed.fetch_add(1, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// The same with callbacks, as in mailItemBetterDesign
+void doMail(MailItem & item, TsQueue<Action *> * p_actionsQueue,
+            float timeScale, std::atomic<size_t> * p_nMailed) {
+  if (item.next(timeScale)) {
+    Action * work = new Action(
+        std::bind(doMail, item, p_actionsQueue, timeScale, p_nMailed));
+    p_actionsQueue->push(work);
+  } else {
+    p_nMailed->fetch_add(1, std::memory_order_release);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Run the workers until all the items are mailed, return the elapsed time
+double runWorkers(int nThreads, std::function<void()> pump,
+                  std::function<bool()> runOne,
+                  std::function<bool()> notFinished) {
+  auto work = [&runOne, &notFinished] {
+    while (runOne() || notFinished())
+      ;
+  };
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(work);
+  pump();
+  work();
+  for (auto & thr : workerThreads)
+    thr.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads> [time scale]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  float timeScale = argc == 4 ? std::stof(argv[3]) : 1.f;
+
+  if (nItems <= 0 || nThreads <= 0 || timeScale < 0.f) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << "Starting with " << nItems << " items and " << nThreads
+            << " threads, time scale " << timeScale << "\n";
+  const double nTasks = 6. * nItems;
+  const size_t queueSize = nItems + 1000;
+
+  // Callbacks: a heap allocated std::function holding a std::bind per stage
+  {
+    TsQueue<Action *> actionsQueue(queueSize);
+    std::atomic<size_t> nMailed{0};
+    auto pump = [&] {
+      for (int i = 0; i < nItems; ++i) {
+        MailItem item(i);
+        actionsQueue.push(new Action(
+            std::bind(doMail, item, &actionsQueue, timeScale, &nMailed)));
+      }
+    };
+    auto runOne = [&actionsQueue] {
+      Action * action = nullptr;
+      if (!actionsQueue.try_pop(action))
+        return false;
+      (*action)();
+      delete action;
+      return true;
+    };
+    auto notFinished = [&] {
+      return nMailed.load(std::memory_order_acquire) < size_t(nItems);
+    };
+    const double elapsed = runWorkers(nThreads, pump, runOne, notFinished);
+    using Bound = decltype(std::bind(doMail, std::declval<MailItem &>(),
+                                     &actionsQueue, timeScale, &nMailed));
+    std::cout << "Callbacks:  " << nTasks / elapsed << " tasks/s, "
+              << sizeof(Action) + sizeof(Bound)
+              << " bytes per in-flight item (Action + bound arguments), "
+              << "one allocation per stage\n";
+  }
+
+  // Coroutines: one pooled frame per item for its whole life
+  {
+    Scheduler scheduler(queueSize);
+    std::atomic<size_t> nMailed{0};
+    auto pump = [&] {
+      for (int i = 0; i < nItems; ++i)
+        processMail(MailItem(i), scheduler, timeScale, nMailed);
+    };
+    auto runOne = [&scheduler] { return scheduler.runOne(); };
+    auto notFinished = [&] {
+      return nMailed.load(std::memory_order_acquire) < size_t(nItems);
+    };
+    const double elapsed = runWorkers(nThreads, pump, runOne, notFinished);
+    std::cout << "Coroutines: " << nTasks / elapsed << " tasks/s, "
+              << FramePool::getMaxFrameSize()
+              << " bytes per in-flight item (coroutine frame), "
+              << FramePool::getBlocksAllocated() << " frame allocations and "
+              << FramePool::getBlocksReused() << " reuses for " << nItems
+              << " items\n";
+  }
+
+  std::cout << "Work finished, threads joined\n";
+}
@@ -0,0 +1,371 @@
+/* Mail item processing with an elastic worker pool
+g++ mailItemElasticPool.cpp -o mailItemElasticPool -std=c++17 -fgnu-tm
+-pthread -Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemElasticPool <mail items> <min threads> <max threads>
+                           [time scale] [idle timeout ms] [decision log file]
+e.g.   mailItemElasticPool 2000 1 16 0.01 20 decisions.log
+
+The solutions start nThreads - 1 workers which spin on the queue until the
+end: at the start the pump is alone to feed them, at the tail of the batch
+most of them spin on an empty queue. Here a supervisor looks at the work
+queue every millisecond and spawns a worker when the queue depth per worker
+or the time the last tasks waited in the queue crosses a threshold, up to
+max threads. A worker which found nothing to do for the idle timeout
+(default 20 ms) retires, down to min threads. Every decision is logged
+(default on the standard output).
+The same items are processed by a fixed pool of max threads, and the
+makespan and the CPU time consumed by the process are compared. The stage
+durations are the ones of mailItemBetterDesign times the time scale
+(default 0.01).
+*/
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Action = std::function<void()>;
+using Duration = std::chrono::duration<float>;
+
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// A queued action, with the time it was queued
+struct Task {
+  Action * action;
+  Clock::time_point queued;
+};
+
+//------------------------------------------------------------------------------
+// Durations of the stages of MailItem::next() in mailItemBetterDesign
+constexpr int kNstages = 6;
+const float gStageDurations[kNstages] = {0.12f, 0.1f, 0.24f,
+                                         0.5f,  0.05f, 0.7f};
+
+//------------------------------------------------------------------------------
+// What the actions of one run share
+struct Pipeline {
+  Pipeline(size_t items, float scale)
+      : nItems(items), timeScale(scale), queue(items + 1000){};
+  const size_t nItems;
+  const float timeScale;
+  TsQueue<Task> queue;
+  std::atomic<size_t> nMailed{0};
+  // the longest wait of a task popped since the supervisor last looked
+  std::atomic<int64_t> maxWaitNs{0};
+  //---------
+  void push(Action * action) { queue.push({action, Clock::now()}); };
+  //---------
+  // Pop and run one action, false if the queue was empty
+  bool runOne() {
+    Task task;
+    if (!queue.try_pop(task))
+      return false;
+    const int64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             Clock::now() - task.queued)
+                             .count();
+    int64_t max = maxWaitNs.load(std::memory_order_relaxed);
+    while (wait > max && !maxWaitNs.compare_exchange_weak(max, wait))
+      ;
+    (*task.action)();
+    delete task.action;
+    return true;
+  };
+  //---------
+  bool isDone() {
+    return nMailed.load(std::memory_order_acquire) == nItems;
+  };
+};
+
+//------------------------------------------------------------------------------
+// One stage of an item, then queue the next one, as in mailItemBetterDesign
+void doMail(int stage, Pipeline * p) {
+  std::this_thread::sleep_for(Duration(gStageDurations[stage] * p->timeScale));
+  if (stage + 1 < kNstages)
+    p->push(new Action(std::bind(doMail, stage + 1, p)));
+  else
+    p->nMailed.fetch_add(1, std::memory_order_release);
+}
+
+void pump(Pipeline * p) {
+  for (size_t i = 0; i < p->nItems; ++i)
+    p->push(new Action(std::bind(doMail, 0, p)));
+}
+
+//------------------------------------------------------------------------------
+// The elastic pool. The supervisor thread grows it, the workers shrink it.
+class ElasticPool {
+public:
+  ElasticPool(Pipeline * pipeline, int minWorkers, int maxWorkers,
+              Duration idleTimeout, std::ostream & log)
+      : m_pipeline(pipeline), m_minWorkers(minWorkers),
+        m_maxWorkers(maxWorkers), m_idleTimeout(idleTimeout), m_log(log),
+        m_start(Clock::now()){};
+  //---------
+  // Start the minimum number of workers and the supervisor, wait for the end
+  void run() {
+    for (int i = 0; i < m_minWorkers; ++i)
+      spawn("minimum");
+    supervise();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto & thr : m_threads)
+      thr.join();
+  };
+  //---------
+  int getMaxSeen() { return m_maxSeen; };
+  int getNspawned() { return m_nSpawned; };
+  int getNretired() { return m_nRetired; };
+
+private:
+  // Thresholds to spawn a worker
+  static constexpr size_t kDepthPerWorker = 4;
+  static constexpr std::chrono::milliseconds kMaxWait{5};
+  static constexpr std::chrono::milliseconds kPeriod{1};
+
+  void supervise() {
+    while (!m_pipeline->isDone()) {
+      std::this_thread::sleep_for(kPeriod);
+      const size_t depth = m_pipeline->queue.getNitems();
+      const auto wait = std::chrono::nanoseconds(
+          m_pipeline->maxWaitNs.exchange(0, std::memory_order_relaxed));
+      const int nWorkers = m_nWorkers.load();
+      if (nWorkers >= m_maxWorkers || m_pipeline->isDone())
+        continue;
+      if (depth > kDepthPerWorker * nWorkers)
+        spawn("queue depth " + std::to_string(depth));
+      else if (wait > kMaxWait)
+        spawn("wait " + std::to_string(wait.count() / 1000) + " us");
+    }
+  };
+
+  void spawn(const std::string & reason) {
+    const int nWorkers = ++m_nWorkers;
+    ++m_nSpawned;
+    m_maxSeen = std::max(m_maxSeen.load(), nWorkers);
+    logDecision("spawn", reason, nWorkers);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_threads.emplace_back(&ElasticPool::work, this);
+  };
+
+  void work() {
+    auto idleSince = Clock::now();
+    while (!m_pipeline->isDone()) {
+      if (m_pipeline->runOne()) {
+        idleSince = Clock::now();
+        continue;
+      }
+      if (Clock::now() - idleSince > m_idleTimeout && retire())
+        return;
+      // do not burn a core while waiting for work
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  };
+
+  // Leave the pool unless it is at its minimum
+  bool retire() {
+    int nWorkers = m_nWorkers.load();
+    while (nWorkers > m_minWorkers) {
+      if (m_nWorkers.compare_exchange_weak(nWorkers, nWorkers - 1)) {
+        ++m_nRetired;
+        logDecision("retire", "idle", nWorkers - 1);
+        return true;
+      }
+    }
+    return false;
+  };
+
+  void logDecision(const char * decision, const std::string & reason,
+                   int nWorkers) {
+    std::chrono::duration<double, std::milli> t = Clock::now() - m_start;
+    std::lock_guard<std::mutex> lock(m_logMutex);
+    m_log << std::fixed << std::setprecision(3) << t.count() << " ms "
+          << decision << " (" << reason << "), " << nWorkers
+          << " workers, queue depth " << m_pipeline->queue.getNitems()
+          << "\n";
+  };
+
+  Pipeline * const m_pipeline;
+  const int m_minWorkers;
+  const int m_maxWorkers;
+  const Duration m_idleTimeout;
+  std::ostream & m_log;
+  const Clock::time_point m_start;
+  std::atomic<int> m_nWorkers{0};
+  std::atomic<int> m_maxSeen{0};
+  std::atomic<int> m_nSpawned{0};
+  std::atomic<int> m_nRetired{0};
+  std::mutex m_mutex; // protects m_threads
+  std::vector<std::thread> m_threads;
+  std::mutex m_logMutex;
+};
+
+//------------------------------------------------------------------------------
+// CPU time used by all the threads of the process so far
+double processCpuSeconds() {
+  timespec time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+// As in the solutions: nThreads - 1 workers spinning until the end, the main
+// thread pumps then works
+void runFixedPool(Pipeline * p, int nThreads) {
+  auto work = [p] {
+    while (!p->isDone())
+      p->runOne();
+  };
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(work);
+  pump(p);
+  work();
+  for (auto & thr : workerThreads)
+    thr.join();
+}
+
+//------------------------------------------------------------------------------
+void printRun(const char * pool, double makespan, double cpuSeconds) {
+  std::cout << pool << ": makespan " << makespan << " s, CPU time "
+            << cpuSeconds << " s (" << cpuSeconds / makespan
+            << " cores busy on average)\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 4 || argc > 7) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <min threads> <max threads> [time scale]"
+                 " [idle timeout ms] [decision log file]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int minThreads = std::stoi(argv[2]);
+  int maxThreads = std::stoi(argv[3]);
+  float timeScale = argc > 4 ? std::stof(argv[4]) : 0.01f;
+  float idleTimeoutMs = argc > 5 ? std::stof(argv[5]) : 20.f;
+
+  if (nItems <= 0 || minThreads <= 0 || maxThreads < minThreads ||
+      timeScale < 0.f || idleTimeoutMs < 0.f) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::ofstream logFile;
+  if (argc > 6) {
+    logFile.open(argv[6]);
+    if (!logFile.is_open()) {
+      std::cerr << "Error opening " << argv[6] << "\n";
+      return 1;
+    }
+  }
+  std::ostream & log = argc > 6 ? logFile : std::cout;
+
+  std::cout << "Starting with " << nItems << " items, " << minThreads
+            << " to " << maxThreads << " threads, time scale " << timeScale
+            << "\n";
+
+  {
+    Pipeline pipeline(nItems, timeScale);
+    const double cpuStart = processCpuSeconds();
+    auto start = Clock::now();
+    runFixedPool(&pipeline, maxThreads);
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    printRun("Fixed pool  ", elapsed.count(), processCpuSeconds() - cpuStart);
+  }
+
+  {
+    Pipeline pipeline(nItems, timeScale);
+    ElasticPool pool(&pipeline, minThreads, maxThreads,
+                     Duration(idleTimeoutMs * 1e-3f), log);
+    const double cpuStart = processCpuSeconds();
+    auto start = Clock::now();
+    std::thread pumpThread(pump, &pipeline);
+    pool.run();
+    pumpThread.join();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    printRun("Elastic pool", elapsed.count(), processCpuSeconds() - cpuStart);
+    std::cout << "Elastic pool: " << pool.getNspawned() << " spawns, "
+              << pool.getNretired() << " retirements, at most "
+              << pool.getMaxSeen() << " workers\n";
+  }
+  std::cout << "Work finished, threads joined\n";
+}
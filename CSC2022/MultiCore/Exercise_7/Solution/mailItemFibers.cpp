@@ -0,0 +1,468 @@
+/* Mail item processing with user space fibers
+g++ mailItemFibers.cpp -o mailItemFibers -std=c++17 -fgnu-tm -pthread
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemFibers <mail items> <n working threads> [time scale]
+                      [max fibers per thread]
+e.g.   mailItemFibers 2000 4 0.01 1024
+
+Some stage code is blocking and cannot be turned into continuations. Here
+every mail item runs such code, MailItem::next() in a plain loop, on a fiber
+(ucontext) of its own. On a fiber blockingSleep() does not block the thread:
+it saves the registers, and the worker resumes another fiber. The fibers and
+their stacks (64 KiB, with a guard page) are recycled by every worker, and a
+started fiber stays on its worker thread.
+The cost of a fiber switch is measured against the one of an OS thread
+switch, then the items are processed with fibers and with blocking OS
+threads, and the throughput and items in flight per thread are printed. The
+stage durations are the ones of MailItem::next() times the time scale
+(default 0.01).
+*/
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Duration = std::chrono::duration<float>;
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// A fiber: the saved registers and the stack of blocking code. The stack is
+// mapped once, with a guard page below it so that an overflow crashes instead
+// of silently corrupting the memory around.
+struct Fiber {
+  static constexpr size_t kStackSize = 64 * 1024;
+
+  Fiber() : m_mappingSize(kStackSize + sysconf(_SC_PAGESIZE)) {
+    m_mapping = mmap(nullptr, m_mappingSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (m_mapping == MAP_FAILED) {
+      std::perror("mmap");
+      std::abort();
+    }
+    mprotect(m_mapping, m_mappingSize - kStackSize, PROT_NONE);
+  };
+  ~Fiber() { munmap(m_mapping, m_mappingSize); };
+  Fiber(const Fiber &) = delete;
+  Fiber & operator=(const Fiber &) = delete;
+
+  char * stack() {
+    return static_cast<char *>(m_mapping) + m_mappingSize - kStackSize;
+  };
+
+  const size_t m_mappingSize;
+  void * m_mapping;
+  ucontext_t m_context;
+  std::function<void()> m_body;
+  Clock::time_point m_wakeUp;
+  bool m_finished = false;
+};
+
+//------------------------------------------------------------------------------
+// The fibers of one worker thread. The worker starts fibers and resumes the
+// ones whose sleep is over; a fiber runs until it sleeps or finishes.
+class FiberScheduler {
+public:
+  FiberScheduler() = default;
+  ~FiberScheduler() {
+    for (auto fiber : m_pool)
+      delete fiber;
+  };
+  FiberScheduler(const FiberScheduler &) = delete;
+  FiberScheduler & operator=(const FiberScheduler &) = delete;
+  //---------
+  // Run body on a fiber until it sleeps or finishes
+  void start(std::function<void()> body) {
+    Fiber * fiber = nullptr;
+    if (m_pool.empty()) {
+      fiber = new Fiber;
+    } else {
+      fiber = m_pool.back();
+      m_pool.pop_back();
+    }
+    fiber->m_body = std::move(body);
+    fiber->m_finished = false;
+    getcontext(&fiber->m_context);
+    fiber->m_context.uc_stack.ss_sp = fiber->stack();
+    fiber->m_context.uc_stack.ss_size = Fiber::kStackSize;
+    fiber->m_context.uc_link = &m_main;
+    makecontext(&fiber->m_context, entry, 0);
+    ++m_nAlive;
+    m_maxAlive = std::max(m_maxAlive, m_nAlive);
+    resume(fiber);
+  };
+  //---------
+  // Resume the fibers whose sleep is over, returns false if none is asleep
+  bool resumeReady() {
+    const auto now = Clock::now();
+    while (!m_sleeping.empty() && m_sleeping.top()->m_wakeUp <= now) {
+      Fiber * fiber = m_sleeping.top();
+      m_sleeping.pop();
+      resume(fiber);
+    }
+    return !m_sleeping.empty();
+  };
+  //---------
+  Clock::time_point nextWakeUp() { return m_sleeping.top()->m_wakeUp; };
+  size_t getNalive() { return m_nAlive; };
+  size_t getMaxAlive() { return m_maxAlive; };
+  //---------
+  // Called on a fiber: give the thread back to the worker until the duration
+  // has elapsed
+  void sleep(Duration duration) {
+    Fiber * fiber = m_current;
+    fiber->m_wakeUp =
+        Clock::now() + std::chrono::duration_cast<Clock::duration>(duration);
+    swapcontext(&fiber->m_context, &m_main);
+  };
+
+  //---------
+  // Switch back and forth between two fibers, returns the time per switch
+  static double measureSwitch(int nSwitches);
+
+private:
+  struct WakesLater {
+    bool operator()(const Fiber * a, const Fiber * b) const {
+      return a->m_wakeUp > b->m_wakeUp;
+    };
+  };
+
+  static void entry();
+
+  void resume(Fiber * fiber) {
+    m_current = fiber;
+    swapcontext(&m_main, &fiber->m_context);
+    m_current = nullptr;
+    if (fiber->m_finished) {
+      --m_nAlive;
+      fiber->m_body = nullptr;
+      m_pool.push_back(fiber);
+    } else {
+      m_sleeping.push(fiber);
+    }
+  };
+
+  ucontext_t m_main;
+  Fiber * m_current = nullptr;
+  std::vector<Fiber *> m_pool;
+  std::priority_queue<Fiber *, std::vector<Fiber *>, WakesLater> m_sleeping;
+  size_t m_nAlive = 0;
+  size_t m_maxAlive = 0;
+};
+
+// The scheduler of the calling thread, if it runs fibers
+thread_local FiberScheduler * tScheduler = nullptr;
+
+void FiberScheduler::entry() {
+  Fiber * fiber = tScheduler->m_current;
+  fiber->m_body();
+  fiber->m_finished = true;
+  // returning switches to uc_link, i.e. back into resume()
+}
+
+double FiberScheduler::measureSwitch(int nSwitches) {
+  FiberScheduler scheduler;
+  FiberScheduler * previous = tScheduler;
+  tScheduler = &scheduler;
+  auto start = Clock::now();
+  scheduler.start([nSwitches] {
+    for (int i = 0; i < nSwitches / 2; ++i)
+      tScheduler->sleep(Duration(0.f));
+  });
+  while (scheduler.resumeReady())
+    ;
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  tScheduler = previous;
+  return elapsed.count() / nSwitches;
+}
+
+//------------------------------------------------------------------------------
+// Blocking code calls this instead of std::this_thread::sleep_for
+void blockingSleep(Duration duration) {
+  if (tScheduler)
+    tScheduler->sleep(duration);
+  else
+    std::this_thread::sleep_for(duration);
+}
+
+//------------------------------------------------------------------------------
+// Small dummy class representing a mail item.
+class MailItem {
+public:
+  enum class State : char {
+    kStart,
+    kFolded,
+    kStuffed,
+    kSealed,
+    kAddressed,
+    kStamped,
+    kMailed
+  };
+
+  MailItem() : m_id(0), m_state(State::kStart){};
+  MailItem(size_t id) : m_id(id), m_state(State::kStart){};
+  size_t getId() { return m_id; };
+  State getState() { return m_state; };
+  // Go through one step of the mail state machine, returns false once mailed
+  bool next(float timeScale) {
+    switch (m_state) {
+    case State::kStart:
+      doWork(State::kFolded, 0.12 * timeScale);
+      return true;
+    case State::kFolded:
+      doWork(State::kStuffed, 0.1 * timeScale);
+      return true;
+    case State::kStuffed:
+      doWork(State::kSealed, 0.24 * timeScale);
+      return true;
+    case State::kSealed:
+      doWork(State::kAddressed, 0.5 * timeScale);
+      return true;
+    case State::kAddressed:
+      doWork(State::kStamped, 0.05 * timeScale);
+      return true;
+    case State::kStamped:
+      doWork(State::kMailed, 0.7 * timeScale);
+      return false;
+    default:
+      return false;
+    }
+  };
+
+private:
+  size_t m_id;
+  State m_state;
+  void doWork(State newState, float deltaTf) {
+    blockingSleep(Duration(deltaTf));
+    m_state = newState;
+  };
+};
+
+//------------------------------------------------------------------------------
+// What the workers of one run share
+struct Pipeline {
+  Pipeline(size_t items, float scale)
+      : nItems(items), timeScale(scale), queue(items){};
+  const size_t nItems;
+  const float timeScale;
+  TsQueue<size_t> queue; // the ids of the items not started yet
+  std::atomic<size_t> nMailed{0};
+  std::atomic<uint64_t> inFlightNs{0}; // sum over the items of their lifetime
+  std::atomic<size_t> maxInFlight{0};  // per thread
+};
+
+void updateMax(std::atomic<size_t> & max, size_t value) {
+  size_t current = max.load(std::memory_order_relaxed);
+  while (value > current && !max.compare_exchange_weak(current, value))
+    ;
+}
+
+// The whole life of an item, in blocking code
+void processItem(size_t id, Pipeline * p) {
+  auto start = Clock::now();
+  MailItem item(id);
+  while (item.next(p->timeScale))
+    ;
+  p->inFlightNs.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start)
+          .count());
+  p->nMailed.fetch_add(1, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// OS threads: the worker blocks for the whole life of the item
+void pullWorkThreads(Pipeline * p) {
+  size_t id = 0;
+  while (p->queue.try_pop(id))
+    processItem(id, p);
+  updateMax(p->maxInFlight, 1);
+}
+
+// Fibers: start new items while below maxFibers, and resume the sleeping ones
+void pullWorkFibers(Pipeline * p, size_t maxFibers) {
+  FiberScheduler scheduler;
+  tScheduler = &scheduler;
+  size_t id = 0;
+  while (p->nMailed.load(std::memory_order_acquire) < p->nItems) {
+    bool started = false;
+    if (scheduler.getNalive() < maxFibers && p->queue.try_pop(id)) {
+      scheduler.start(std::bind(processItem, id, p));
+      started = true;
+    }
+    const bool sleeping = scheduler.resumeReady();
+    if (started)
+      continue;
+    if (sleeping)
+      std::this_thread::sleep_until(scheduler.nextWakeUp());
+    else if (scheduler.getNalive() == 0 && p->queue.getNitems() == 0)
+      break; // the other workers finish the last items
+  }
+  tScheduler = nullptr;
+  updateMax(p->maxInFlight, scheduler.getMaxAlive());
+}
+
+//------------------------------------------------------------------------------
+// Ping-pong between two OS threads, returns the time per switch
+double measureThreadSwitch(int nSwitches) {
+  std::mutex mutex;
+  std::condition_variable turnChanged;
+  int turn = 0;
+  auto play = [&](int me) {
+    for (int i = 0; i < nSwitches / 2; ++i) {
+      std::unique_lock<std::mutex> lock(mutex);
+      turnChanged.wait(lock, [&] { return turn == me; });
+      turn = 1 - me;
+      turnChanged.notify_one();
+    }
+  };
+  auto start = Clock::now();
+  std::thread other(play, 1);
+  play(0);
+  other.join();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  return elapsed.count() / nSwitches;
+}
+
+//------------------------------------------------------------------------------
+void run(const char * design, size_t nItems, int nThreads, float timeScale,
+         size_t maxFibers) {
+  Pipeline pipeline(nItems, timeScale);
+  for (size_t i = nItems; i > 0; --i)
+    pipeline.queue.push(i - 1);
+
+  const bool fibers = std::string(design) == "fibers";
+  auto work = [&] {
+    if (fibers)
+      pullWorkFibers(&pipeline, maxFibers);
+    else
+      pullWorkThreads(&pipeline);
+  };
+  auto start = Clock::now();
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(work);
+  work();
+  for (auto & thr : workerThreads)
+    thr.join();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  // Little's law: mean number in flight = total time in flight / makespan
+  const double inFlight =
+      pipeline.inFlightNs.load() * 1e-9 / elapsed.count() / nThreads;
+  std::cout << design << ": " << nItems / elapsed.count() << " items/s, "
+            << inFlight << " items in flight per thread on average, "
+            << pipeline.maxInFlight.load() << " at most\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads> [time scale]"
+                 " [max fibers per thread]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  float timeScale = argc > 3 ? std::stof(argv[3]) : 0.01f;
+  int maxFibers = argc > 4 ? std::stoi(argv[4]) : 1024;
+
+  if (nItems <= 0 || nThreads <= 0 || timeScale < 0.f || maxFibers <= 0) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  const int nSwitches = 200000;
+  std::cout << "Fiber switch:     "
+            << 1e9 * FiberScheduler::measureSwitch(nSwitches) << " ns\n"
+            << "OS thread switch: " << 1e9 * measureThreadSwitch(nSwitches)
+            << " ns\n";
+
+  std::cout << "Starting with " << nItems << " items and " << nThreads
+            << " threads, time scale " << timeScale << "\n";
+  run("OS threads", nItems, nThreads, timeScale, maxFibers);
+  run("fibers", nItems, nThreads, timeScale, maxFibers);
+  std::cout << "Work finished, threads joined\n";
+}
@@ -0,0 +1,407 @@
+/* Earliest deadline first and priority scheduling of the mail items
+g++ mailItemPriority.cpp -o mailItemPriority -std=c++17 -fgnu-tm -pthread
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemPriority <mail items> <threads> [time scale]
+                        [schedulers]
+e.g.   mailItemPriority 2000 16 0.01 plain,edf,priority
+
+Every item gets a class when it is created (10% urgent, 30% normal, 60%
+bulk, drawn with a fixed seed) and its own deadline relative to the start of
+the batch. Item i is released at i / items times the expected makespan (the
+total work of the batch divided by the number of threads) and is due its
+own work plus a slack after that: 0.02, 0.1 and 0.15 times the expected
+makespan for its class. So an early bulk item can be due before a late
+urgent one, and the two ordered schedulers differ. The schedulers are:
+  plain:    the TsQueue of the solutions, which runs the last action pushed
+  edf:      a relaxed priority queue ordered by deadline
+  priority: the same queue ordered by class, then deadline
+The relaxed priority queue is a multi-queue: 2 heaps per thread, each with
+its own lock. A push goes to a random heap and a pop takes the best of two
+random heaps, so the threads rarely meet on a lock and the action popped is
+one of the first ones, not always the very first. Every stage of an item
+inherits its key, so an urgent item stays urgent until it is mailed.
+For every scheduler the makespan, the throughput and the deadline miss rate
+(overall and per class) are printed. The stage durations are the ones of
+mailItemBetterDesign times the time scale (default 0.01).
+With the example above, plain misses about half of the deadlines, edf none,
+and priority keeps the urgent items on time but misses about 70% of the
+bulk ones. When the makespan is well above the expected one, e.g. at a time
+scale of 0.002, edf misses in every class while priority still protects the
+urgent items.
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Action = std::function<void()>;
+using Duration = std::chrono::duration<float>;
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// A queued action and its scheduling key, smaller runs first
+struct Task {
+  Action * action;
+  uint64_t key;
+};
+
+//------------------------------------------------------------------------------
+// Thread local xorshift generator, cheap enough to be called on every push
+// and pop
+uint64_t nextRandom() {
+  thread_local uint64_t tState =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+  tState ^= tState << 13;
+  tState ^= tState >> 7;
+  tState ^= tState << 17;
+  return tState;
+}
+
+//------------------------------------------------------------------------------
+// Relaxed concurrent priority queue: a set of locked binary heaps. Each heap
+// publishes the key of its top so that pop() can compare two heaps without
+// locking them.
+template <class T> class MultiQueue {
+public:
+  MultiQueue(size_t nHeaps)
+      : m_nHeaps(nHeaps), m_heaps(std::make_unique<Heap[]>(nHeaps)){};
+  //---------
+  void push(const T & item) {
+    while (true) {
+      Heap & heap = m_heaps[nextRandom() % m_nHeaps];
+      std::unique_lock<std::mutex> lock(heap.mutex, std::try_to_lock);
+      if (!lock.owns_lock())
+        continue; // another heap is as good as this one
+      heap.items.push_back(item);
+      std::push_heap(heap.items.begin(), heap.items.end(), Later());
+      heap.top.store(heap.items.front().key, std::memory_order_relaxed);
+      return;
+    }
+  };
+  //---------
+  // false only when every heap was seen empty
+  bool try_pop(T & item) {
+    while (true) {
+      size_t i = nextRandom() % m_nHeaps;
+      size_t j = nextRandom() % m_nHeaps;
+      if (m_heaps[j].top.load(std::memory_order_relaxed) <
+          m_heaps[i].top.load(std::memory_order_relaxed))
+        i = j;
+      if (m_heaps[i].top.load(std::memory_order_relaxed) == kEmpty) {
+        // both empty: look for any non empty heap before giving up
+        i = findNonEmpty();
+        if (i == m_nHeaps)
+          return false;
+      }
+      Heap & heap = m_heaps[i];
+      std::unique_lock<std::mutex> lock(heap.mutex, std::try_to_lock);
+      if (!lock.owns_lock() || heap.items.empty())
+        continue;
+      std::pop_heap(heap.items.begin(), heap.items.end(), Later());
+      item = heap.items.back();
+      heap.items.pop_back();
+      heap.top.store(heap.items.empty() ? kEmpty : heap.items.front().key,
+                     std::memory_order_relaxed);
+      return true;
+    }
+  };
+
+private:
+  static constexpr uint64_t kEmpty = std::numeric_limits<uint64_t>::max();
+
+  struct Later {
+    bool operator()(const T & a, const T & b) const { return a.key > b.key; };
+  };
+
+  struct alignas(64) Heap {
+    std::mutex mutex;
+    std::vector<T> items;
+    std::atomic<uint64_t> top{kEmpty};
+  };
+
+  size_t findNonEmpty() {
+    const size_t start = nextRandom() % m_nHeaps;
+    for (size_t n = 0; n < m_nHeaps; ++n) {
+      const size_t i = (start + n) % m_nHeaps;
+      if (m_heaps[i].top.load(std::memory_order_relaxed) != kEmpty)
+        return i;
+    }
+    return m_nHeaps;
+  };
+
+  const size_t m_nHeaps;
+  std::unique_ptr<Heap[]> m_heaps;
+};
+
+//------------------------------------------------------------------------------
+// Durations of the stages of MailItem::next() in mailItemBetterDesign
+constexpr int kNstages = 6;
+const float gStageDurations[kNstages] = {0.12f, 0.1f, 0.24f,
+                                         0.5f,  0.05f, 0.7f};
+
+enum Class { kUrgent, kNormal, kBulk, kNclasses };
+const char * gClassNames[kNclasses] = {"urgent", "normal", "bulk"};
+// Share of the items and slack of the deadline relative to the expected
+// makespan
+const double gClassShares[kNclasses] = {0.1, 0.3, 0.6};
+const double gClassSlacks[kNclasses] = {0.02, 0.1, 0.15};
+
+//------------------------------------------------------------------------------
+struct MailItem {
+  int id;
+  Class itemClass;
+  Clock::duration deadline; // since the start of the batch
+  Clock::duration mailed;
+};
+
+// The same batch for every scheduler. Item i is released at i / nItems of
+// the expected makespan, the time a FIFO would reach it, and is due its own
+// work plus the slack of its class after that.
+std::vector<MailItem> makeItems(int nItems, Duration itemWork,
+                                Duration expectedMakespan) {
+  std::mt19937 generator(2022);
+  std::discrete_distribution<int> classes(gClassShares,
+                                          gClassShares + kNclasses);
+  std::vector<MailItem> items(nItems);
+  for (int i = 0; i < nItems; ++i) {
+    items[i].id = i;
+    items[i].itemClass = Class(classes(generator));
+    const Duration release = expectedMakespan * (double(i) / nItems);
+    items[i].deadline = std::chrono::duration_cast<Clock::duration>(
+        release + itemWork +
+        expectedMakespan * gClassSlacks[items[i].itemClass]);
+  }
+  return items;
+}
+
+//------------------------------------------------------------------------------
+enum class Scheduler { kPlain, kEdf, kPriority };
+
+// What the actions of one run share
+template <class Queue> struct Pipeline {
+  Pipeline(std::vector<MailItem> & batch, float scale, Queue & q,
+           Scheduler s)
+      : items(batch), timeScale(scale), queue(q), scheduler(s){};
+  std::vector<MailItem> & items;
+  const float timeScale;
+  Queue & queue;
+  const Scheduler scheduler;
+  Clock::time_point start;
+  std::atomic<size_t> nMailed{0};
+  //---------
+  uint64_t keyOf(const MailItem & item) {
+    const uint64_t deadline =
+        std::chrono::duration_cast<std::chrono::microseconds>(item.deadline)
+            .count();
+    if (scheduler == Scheduler::kPriority)
+      return uint64_t(item.itemClass) << 40 | deadline;
+    return deadline;
+  };
+  //---------
+  bool isDone() {
+    return nMailed.load(std::memory_order_acquire) == items.size();
+  };
+};
+
+//------------------------------------------------------------------------------
+// One stage of an item, then queue the next one, as in mailItemBetterDesign
+template <class Queue>
+void doMail(int stage, MailItem * item, Pipeline<Queue> * p) {
+  std::this_thread::sleep_for(Duration(gStageDurations[stage] * p->timeScale));
+  if (stage + 1 < kNstages) {
+    p->queue.push(
+        {new Action(std::bind(doMail<Queue>, stage + 1, item, p)),
+         p->keyOf(*item)});
+    return;
+  }
+  item->mailed = Clock::now() - p->start;
+  p->nMailed.fetch_add(1, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// nThreads - 1 workers, the main thread pumps then works. Returns the
+// makespan in seconds.
+template <class Queue>
+double run(std::vector<MailItem> & items, int nThreads, float timeScale,
+           Queue & queue, Scheduler scheduler) {
+  Pipeline<Queue> pipeline(items, timeScale, queue, scheduler);
+  auto work = [&pipeline] {
+    Task task;
+    while (!pipeline.isDone()) {
+      if (pipeline.queue.try_pop(task)) {
+        (*task.action)();
+        delete task.action;
+      }
+    }
+  };
+  pipeline.start = Clock::now();
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(work);
+  for (auto & item : items)
+    queue.push({new Action(std::bind(doMail<Queue>, 0, &item, &pipeline)),
+                pipeline.keyOf(item)});
+  work();
+  for (auto & thr : workerThreads)
+    thr.join();
+  std::chrono::duration<double> elapsed = Clock::now() - pipeline.start;
+  return elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+void printResults(const std::string & name, const std::vector<MailItem> & items,
+                  double makespan) {
+  int nItems[kNclasses] = {0};
+  int nMissed[kNclasses] = {0};
+  for (auto & item : items) {
+    ++nItems[item.itemClass];
+    if (item.mailed > item.deadline)
+      ++nMissed[item.itemClass];
+  }
+  std::cout << std::setw(10) << name << std::setw(14) << makespan
+            << std::setw(14) << items.size() / makespan;
+  int nAllMissed = 0;
+  for (int c = 0; c < kNclasses; ++c) {
+    nAllMissed += nMissed[c];
+    std::cout << std::setw(12)
+              << (nItems[c] ? 100. * nMissed[c] / nItems[c] : 0.);
+  }
+  std::cout << std::setw(12) << 100. * nAllMissed / items.size() << "\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <threads> [time scale] [schedulers]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  float timeScale = argc > 3 ? std::stof(argv[3]) : 0.01f;
+  std::vector<std::string> schedulers;
+  std::istringstream list(argc > 4 ? argv[4] : "plain,edf,priority");
+  std::string scheduler;
+  while (std::getline(list, scheduler, ','))
+    schedulers.push_back(scheduler);
+
+  if (nItems <= 0 || nThreads <= 0 || timeScale <= 0.f) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  float work = 0.f;
+  for (float duration : gStageDurations)
+    work += duration * timeScale;
+  const Duration expectedMakespan(work * nItems / nThreads);
+
+  std::cout << "Starting with " << nItems << " items and " << nThreads
+            << " threads, expected makespan " << expectedMakespan.count()
+            << " s\n"
+            << "Missed deadlines in %\n"
+            << std::setw(10) << "scheduler" << std::setw(14) << "makespan [s]"
+            << std::setw(14) << "items/s";
+  for (auto name : gClassNames)
+    std::cout << std::setw(12) << name;
+  std::cout << std::setw(12) << "all"
+            << "\n";
+
+  for (auto & name : schedulers) {
+    std::vector<MailItem> items =
+        makeItems(nItems, Duration(work), expectedMakespan);
+    double makespan;
+    if (name == "plain") {
+      TsQueue<Task> queue(nItems + 1000);
+      makespan = run(items, nThreads, timeScale, queue, Scheduler::kPlain);
+    } else if (name == "edf" || name == "priority") {
+      MultiQueue<Task> queue(2 * nThreads);
+      makespan = run(items, nThreads, timeScale, queue,
+                     name == "edf" ? Scheduler::kEdf : Scheduler::kPriority);
+    } else {
+      std::cerr << "Unknown scheduler: " << name << "\n";
+      return 1;
+    }
+    printResults(name, items, makespan);
+  }
+  std::cout << "Work finished, threads joined\n";
+}
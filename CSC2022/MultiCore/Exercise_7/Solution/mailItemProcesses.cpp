@@ -0,0 +1,591 @@
+/* Mail item processing sharded over processes sharing memory
+g++ mailItemProcesses.cpp -o mailItemProcesses -std=c++17 -pthread -lrt
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemProcesses <mail items> <workers> [time scale] [pin|nopin]
+                         [crash after]
+e.g.   mailItemProcesses 2000 8 0.01 pin 500
+
+The queues and the state of the items live in a shm_open/mmap region, and
+refer to each other by offsets and indexes, never by pointers, so the
+region can be mapped at any address by any process. Every worker owns a
+shard: a bounded non-blocking queue (Vyukov's MPMC queue, not strictly
+lock-free: a worker stopped in a push or pop holds its cell) which first
+holds the items i with i % workers == shard, and in which the worker pushes
+the next stage of the items it runs. A worker whose queue is empty steals
+from the others.
+The same batch is processed twice on the same number of workers: by threads
+of this process, then by forked processes. Pinned workers are bound to the
+core shard % cores. The coordinator (the main process) waits for the
+processes. When one dies before the end, it may have died in the middle of
+a queue operation, leaving a cell claimed but never published, which would
+block its queue for good. So the coordinator pauses the other workers
+between two actions, rebuilds every queue from the state of the items (one
+atomic word: stage, phase, owner), puts back the items the dead process was
+running, and forks a new process for its shard. With 'crash after' N, the
+first process of shard 0 kills itself with SIGKILL after N stages to show
+it. A worker drops any copy of an item whose state does not match, so no
+stage runs twice.
+The stage durations are the ones of mailItemBetterDesign times the time
+scale (default 0.01, 0 measures the queues alone).
+*/
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the atomics in shared memory must be lock free");
+
+//------------------------------------------------------------------------------
+// Durations of the stages of MailItem::next() in mailItemBetterDesign
+constexpr int kNstages = 6;
+const float gStageDurations[kNstages] = {0.12f, 0.1f, 0.24f,
+                                         0.5f,  0.05f, 0.7f};
+
+constexpr size_t roundUp64(size_t n) { return (n + 63) / 64 * 64; }
+
+//------------------------------------------------------------------------------
+// A shm_open region, unlinked when the object is destroyed. The forked
+// processes inherit the mapping, any other process could map it by name.
+class SharedRegion {
+public:
+  SharedRegion(const std::string & name, size_t size)
+      : m_name(name), m_size(size) {
+    int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "shm_open");
+    if (ftruncate(fd, m_size) != 0) {
+      const int error = errno;
+      close(fd);
+      shm_unlink(m_name.c_str());
+      throw std::system_error(error, std::generic_category(), "ftruncate");
+    }
+    void * base =
+        mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int error = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+      shm_unlink(m_name.c_str());
+      throw std::system_error(error, std::generic_category(), "mmap");
+    }
+    m_base = static_cast<char *>(base);
+  }
+  ~SharedRegion() {
+    munmap(m_base, m_size);
+    shm_unlink(m_name.c_str());
+  };
+  SharedRegion(const SharedRegion &) = delete;
+  SharedRegion & operator=(const SharedRegion &) = delete;
+  //---------
+  template <class T> T * at(size_t offset) {
+    return reinterpret_cast<T *>(m_base + offset);
+  }
+
+private:
+  const std::string m_name;
+  const size_t m_size;
+  char * m_base;
+};
+
+//------------------------------------------------------------------------------
+// Bounded MPMC queue of (item, stage) pairs laid out in place: the cells
+// follow the header in the region.
+class ShmQueue {
+public:
+  static size_t bytes(size_t capacity) {
+    return roundUp64(sizeof(ShmQueue) + capacity * sizeof(Cell));
+  };
+  //---------
+  // capacity is a power of 2
+  ShmQueue(size_t capacity) : m_mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i)
+      new (cells() + i) Cell{{i}, 0, 0};
+  };
+  //---------
+  bool try_push(uint32_t item, uint32_t stage) {
+    uint64_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+      Cell & cell = cells()[pos & m_mask];
+      const uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+      if (seq == pos) {
+        if (m_enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          cell.item = item;
+          cell.stage = stage;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (seq < pos) {
+        return false; // full
+      } else {
+        pos = m_enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+  };
+  //---------
+  void push(uint32_t item, uint32_t stage) {
+    while (!try_push(item, stage))
+      std::this_thread::yield();
+  };
+  //---------
+  bool try_pop(uint32_t & item, uint32_t & stage) {
+    uint64_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    while (true) {
+      Cell & cell = cells()[pos & m_mask];
+      const uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+      if (seq == pos + 1) {
+        if (m_dequeuePos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          item = cell.item;
+          stage = cell.stage;
+          cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (seq < pos + 1) {
+        return false; // empty
+      } else {
+        pos = m_dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+  };
+
+private:
+  struct Cell {
+    std::atomic<uint64_t> sequence;
+    uint32_t item;
+    uint32_t stage;
+  };
+
+  Cell * cells() { return reinterpret_cast<Cell *>(this + 1); };
+
+  const uint64_t m_mask;
+  alignas(64) std::atomic<uint64_t> m_enqueuePos{0};
+  alignas(64) std::atomic<uint64_t> m_dequeuePos{0};
+};
+
+//------------------------------------------------------------------------------
+// State of an item in one word: stage, phase and owner shard
+enum Phase : uint32_t { kQueued, kRunning, kMailed };
+
+constexpr uint32_t packState(uint32_t stage, Phase phase, uint32_t owner) {
+  return stage << 24 | phase << 16 | owner;
+}
+constexpr uint32_t stageOf(uint32_t state) { return state >> 24; }
+constexpr Phase phaseOf(uint32_t state) {
+  return Phase(state >> 16 & 0xff);
+}
+constexpr uint32_t ownerOf(uint32_t state) { return state & 0xffff; }
+
+//------------------------------------------------------------------------------
+struct SharedHeader {
+  uint32_t nItems;
+  uint32_t nShards;
+  float timeScale;
+  size_t queueBytes;
+  size_t queueCapacity;
+  std::atomic<uint32_t> go{0};
+  std::atomic<uint32_t> nMailed{0};
+  std::atomic<uint32_t> pause{0}; // set by the coordinator to recover
+};
+
+// Written by the worker of the shard, and by the coordinator while the
+// workers are paused
+struct alignas(64) ShardStats {
+  std::atomic<uint64_t> stages{0};
+  std::atomic<uint64_t> mailed{0};
+  std::atomic<uint64_t> steals{0};
+  std::atomic<uint64_t> staleCopies{0};
+  std::atomic<uint32_t> parked{0};
+};
+
+//------------------------------------------------------------------------------
+// Where things are in the region, as offsets from its start
+struct Layout {
+  Layout(uint32_t nItems, uint32_t nShards) {
+    capacity = 1;
+    while (capacity < nItems) // an item is in one queue at most
+      capacity *= 2;
+    queueBytes = ShmQueue::bytes(capacity);
+    queues = roundUp64(sizeof(SharedHeader));
+    items = queues + nShards * queueBytes;
+    stats = roundUp64(items + nItems * sizeof(std::atomic<uint32_t>));
+    size = stats + nShards * sizeof(ShardStats);
+  };
+  size_t capacity;
+  size_t queueBytes;
+  size_t queues;
+  size_t items;
+  size_t stats;
+  size_t size;
+};
+
+// The view of the region of one process: pointers computed from the offsets
+struct Shared {
+  Shared(SharedRegion & region, const Layout & layout)
+      : header(region.at<SharedHeader>(0)),
+        queueBase(region.at<char>(layout.queues)),
+        items(region.at<std::atomic<uint32_t>>(layout.items)),
+        stats(region.at<ShardStats>(layout.stats)){};
+  ShmQueue & queue(uint32_t shard) {
+    return *reinterpret_cast<ShmQueue *>(queueBase +
+                                         shard * header->queueBytes);
+  };
+  SharedHeader * header;
+  char * queueBase;
+  std::atomic<uint32_t> * items;
+  ShardStats * stats;
+};
+
+void initialize(Shared & shared, const Layout & layout, uint32_t nItems,
+                uint32_t nShards, float timeScale) {
+  SharedHeader * header = new (shared.header) SharedHeader;
+  header->nItems = nItems;
+  header->nShards = nShards;
+  header->timeScale = timeScale;
+  header->queueBytes = layout.queueBytes;
+  header->queueCapacity = layout.capacity;
+  for (uint32_t s = 0; s < nShards; ++s) {
+    new (&shared.queue(s)) ShmQueue(layout.capacity);
+    new (shared.stats + s) ShardStats;
+  }
+  for (uint32_t i = 0; i < nItems; ++i) {
+    new (shared.items + i)
+        std::atomic<uint32_t>(packState(0, kQueued, i % nShards));
+    shared.queue(i % nShards).push(i, 0);
+  }
+}
+
+//------------------------------------------------------------------------------
+void pinToCore(uint32_t shard) {
+  const unsigned nCores = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(shard % nCores, &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus); // the calling thread only
+}
+
+//------------------------------------------------------------------------------
+// Take the next action: from the own shard first, then from the others
+bool popAction(Shared & shared, uint32_t shard, uint32_t & item,
+               uint32_t & stage) {
+  const uint32_t nShards = shared.header->nShards;
+  for (uint32_t n = 0; n < nShards; ++n) {
+    const uint32_t victim = (shard + n) % nShards;
+    if (shared.queue(victim).try_pop(item, stage)) {
+      if (n > 0) {
+        std::atomic<uint64_t> & steals = shared.stats[shard].steals;
+        steals.store(steals.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// The loop of a worker, in a thread or in a process. With crashAfter > 0
+// the process kills itself after that many stages.
+void work(Shared & shared, uint32_t shard, bool pin, uint64_t crashAfter) {
+  if (pin)
+    pinToCore(shard);
+  SharedHeader & header = *shared.header;
+  ShardStats & stats = shared.stats[shard];
+  while (!header.go.load(std::memory_order_acquire))
+    std::this_thread::yield();
+
+  uint64_t nStages = 0;
+  uint32_t item, stage;
+  while (header.nMailed.load(std::memory_order_acquire) < header.nItems) {
+    if (header.pause.load()) {
+      // between two actions: the queues can be rebuilt under our feet
+      stats.parked.store(1);
+      while (header.pause.load())
+        std::this_thread::yield();
+      stats.parked.store(0);
+      continue;
+    }
+    if (!popAction(shared, shard, item, stage)) {
+      std::this_thread::yield();
+      continue;
+    }
+    // a stale copy fails here: its item has moved on, or runs elsewhere
+    std::atomic<uint32_t> & state = shared.items[item];
+    uint32_t expected = state.load(std::memory_order_acquire);
+    if (stageOf(expected) != stage || phaseOf(expected) != kQueued ||
+        !state.compare_exchange_strong(expected,
+                                       packState(stage, kRunning, shard))) {
+      stats.staleCopies.store(
+          stats.staleCopies.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+      continue;
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<float>(
+        gStageDurations[stage] * header.timeScale));
+    stats.stages.store(++nStages, std::memory_order_relaxed);
+    if (crashAfter > 0 && nStages == crashAfter)
+      raise(SIGKILL);
+
+    if (stage + 1 < kNstages) {
+      state.store(packState(stage + 1, kQueued, shard),
+                  std::memory_order_release);
+      // a queue blocked by a dead worker is rebuilt with this item in it
+      while (!shared.queue(shard).try_push(item, stage + 1) &&
+             !header.pause.load())
+        std::this_thread::yield();
+    } else {
+      state.store(packState(stage, kMailed, shard), std::memory_order_release);
+      stats.mailed.store(stats.mailed.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+      header.nMailed.fetch_add(1, std::memory_order_acq_rel);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Called while the workers are paused: empty every queue and queue again each
+// unfinished item, in the shard of its last owner. The items running on a
+// dead worker are queued too, their count is returned.
+uint32_t rebuild(Shared & shared, const std::vector<uint32_t> & deadShards) {
+  SharedHeader & header = *shared.header;
+  for (uint32_t s = 0; s < header.nShards; ++s)
+    new (&shared.queue(s)) ShmQueue(header.queueCapacity);
+  for (uint32_t shard : deadShards)
+    shared.stats[shard].mailed.store(0);
+  uint32_t nMailed = 0, nRecovered = 0;
+  for (uint32_t i = 0; i < header.nItems; ++i) {
+    std::atomic<uint32_t> & state = shared.items[i];
+    const uint32_t current = state.load();
+    const uint32_t owner = ownerOf(current);
+    if (phaseOf(current) == kMailed) {
+      ++nMailed;
+      // the dead one may have died before counting it
+      if (std::count(deadShards.begin(), deadShards.end(), owner))
+        shared.stats[owner].mailed.fetch_add(1);
+      continue;
+    }
+    nRecovered += phaseOf(current) == kRunning;
+    state.store(packState(stageOf(current), kQueued, owner));
+    shared.queue(owner).push(i, stageOf(current));
+  }
+  header.nMailed.store(nMailed);
+  return nRecovered;
+}
+
+//------------------------------------------------------------------------------
+struct RunResults {
+  double makespan;
+  uint32_t nCrashes;
+  uint32_t nRecovered;
+};
+
+RunResults runThreads(Shared & shared, uint32_t nShards, bool pin) {
+  std::vector<std::thread> workers;
+  for (uint32_t s = 0; s < nShards; ++s)
+    workers.emplace_back([&shared, s, pin] { work(shared, s, pin, 0); });
+  auto start = std::chrono::steady_clock::now();
+  shared.header->go.store(1, std::memory_order_release);
+  for (auto & thr : workers)
+    thr.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return {elapsed.count(), 0, 0};
+}
+
+//---------
+pid_t forkWorker(Shared & shared, uint32_t shard, bool pin,
+                 uint64_t crashAfter) {
+  const pid_t pid = fork();
+  if (pid == 0) {
+    work(shared, shard, pin, crashAfter);
+    _exit(0);
+  }
+  return pid;
+}
+
+RunResults runProcesses(Shared & shared, uint32_t nShards, bool pin,
+                        uint64_t crashAfter) {
+  RunResults results{0., 0, 0};
+  std::vector<pid_t> pids;
+  for (uint32_t s = 0; s < nShards; ++s) {
+    pids.push_back(forkWorker(shared, s, pin, s == 0 ? crashAfter : 0));
+    if (pids.back() < 0) {
+      std::perror("fork");
+      std::exit(1);
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+  shared.header->go.store(1, std::memory_order_release);
+
+  // The coordinator: replace the workers which die before the end
+  SharedHeader & header = *shared.header;
+  auto finished = [&header] { return header.nMailed.load() == header.nItems; };
+  size_t nRunning = pids.size();
+  while (nRunning > 0) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0)
+      break;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && finished()) {
+      --nRunning;
+      continue;
+    }
+    std::vector<uint32_t> deadShards;
+    auto bury = [&](pid_t pid, int status) {
+      const uint32_t shard =
+          std::find(pids.begin(), pids.end(), pid) - pids.begin();
+      deadShards.push_back(shard);
+      ++results.nCrashes;
+      std::cout << "Worker " << shard << " (pid " << pid << ") died"
+                << (WIFSIGNALED(status)
+                        ? std::string(" on signal ") +
+                              std::to_string(WTERMSIG(status))
+                        : std::string())
+                << "\n";
+    };
+    bury(pid, status);
+
+    // Wait for the others to park, burying those which die meanwhile
+    header.pause.store(1);
+    while (!finished()) {
+      bool allParked = true;
+      for (uint32_t s = 0; s < nShards; ++s)
+        allParked &= shared.stats[s].parked.load() == 1 ||
+                     std::count(deadShards.begin(), deadShards.end(), s);
+      if (allParked)
+        break;
+      pid = waitpid(-1, &status, WNOHANG);
+      if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+          finished())
+        --nRunning;
+      else if (pid > 0)
+        bury(pid, status);
+      std::this_thread::yield();
+    }
+    if (!finished()) {
+      const uint32_t nRecovered = rebuild(shared, deadShards);
+      results.nRecovered += nRecovered;
+      std::cout << "Queues rebuilt, " << nRecovered
+                << " items put back, restarting " << deadShards.size()
+                << " worker(s)\n";
+    }
+    header.pause.store(0);
+    for (uint32_t shard : deadShards) {
+      // it may have died parked: its replacement must not look parked
+      shared.stats[shard].parked.store(0);
+      pids[shard] = forkWorker(shared, shard, pin, 0);
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  results.makespan = elapsed.count();
+  return results;
+}
+
+//------------------------------------------------------------------------------
+// Aggregate the statistics of the shards and check every item was mailed
+// once
+bool printResults(const char * mode, Shared & shared,
+                  const RunResults & results) {
+  const SharedHeader & header = *shared.header;
+  uint64_t stages = 0, mailed = 0, steals = 0, stale = 0;
+  uint64_t minMailed = ~0ull, maxMailed = 0;
+  for (uint32_t s = 0; s < header.nShards; ++s) {
+    const ShardStats & stats = shared.stats[s];
+    stages += stats.stages.load();
+    mailed += stats.mailed.load();
+    steals += stats.steals.load();
+    stale += stats.staleCopies.load();
+    minMailed = std::min<uint64_t>(minMailed, stats.mailed.load());
+    maxMailed = std::max<uint64_t>(maxMailed, stats.mailed.load());
+  }
+  bool correct = mailed == header.nItems;
+  for (uint32_t i = 0; i < header.nItems; ++i)
+    correct &= phaseOf(shared.items[i].load()) == kMailed;
+  // the stages lost in a crash are run again
+  correct &=
+      results.nCrashes > 0 || stages == uint64_t(header.nItems) * kNstages;
+
+  std::cout << std::setw(10) << mode << std::setw(14) << results.makespan
+            << std::setw(12) << header.nItems / results.makespan
+            << std::setw(10) << steals << std::setw(8) << stale
+            << std::setw(9) << results.nCrashes << std::setw(11)
+            << results.nRecovered << std::setw(7) << minMailed << "-"
+            << maxMailed << "  " << (correct ? "ok" : "WRONG") << "\n";
+  return correct;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 6) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <workers> [time scale] [pin|nopin]"
+                 " [crash after]\n";
+    return 1;
+  }
+
+  const long nItems = std::stol(argv[1]);
+  const long nShards = std::stol(argv[2]);
+  const float timeScale = argc > 3 ? std::stof(argv[3]) : 0.01f;
+  const std::string pinning = argc > 4 ? argv[4] : "pin";
+  const long crashAfter = argc > 5 ? std::stol(argv[5]) : 0;
+
+  if (nItems <= 0 || nItems >= (1l << 30) || nShards <= 0 ||
+      nShards > 0xffff || timeScale < 0.f ||
+      (pinning != "pin" && pinning != "nopin") || crashAfter < 0) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+  const bool pin = pinning == "pin";
+
+  std::cout << "Starting with " << nItems << " items and " << nShards
+            << " workers\n"
+            << std::setw(10) << "workers" << std::setw(14) << "makespan [s]"
+            << std::setw(12) << "items/s" << std::setw(10) << "steals"
+            << std::setw(8) << "stale" << std::setw(9) << "crashes"
+            << std::setw(11) << "recovered" << std::setw(15)
+            << "mailed/worker"
+            << "\n";
+
+  const Layout layout(nItems, nShards);
+  bool correct = true;
+  try {
+    for (const char * mode : {"threads", "processes"}) {
+      const std::string name = "/mailItemProcesses." +
+                               std::to_string(getpid()) + "." + mode;
+      SharedRegion region(name, layout.size);
+      Shared shared(region, layout);
+      initialize(shared, layout, nItems, nShards, timeScale);
+      const RunResults results =
+          mode == std::string("threads")
+              ? runThreads(shared, nShards, pin)
+              : runProcesses(shared, nShards, pin, crashAfter);
+      correct &= printResults(mode, shared, results);
+    }
+  } catch (const std::system_error & error) {
+    std::cerr << error.what() << "\n";
+    return 1;
+  }
+  std::cout << "Work finished, workers joined\n";
+  return correct ? 0 : 1;
+}
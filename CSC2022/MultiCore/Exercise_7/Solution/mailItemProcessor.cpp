@@ -1,9 +1,20 @@
 /* Example program that introduces to task based parallelism
 g++ mailItemProcessor.cpp -o mailItemProcessor -std=c++17 -fgnu-tm -pthread
 */
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
@@ -80,35 +91,362 @@ private:
 // Some useful globals
 using Action = std::function<void()>;
 using TsActionPtrQueue = TsQueue<Action *>;
-TsActionPtrQueue * gActionsQueue = new TsActionPtrQueue(1000);
-TsActionPtrQueue * gMsgQueue = new TsActionPtrQueue(100);
 
 //------------------------------------------------------------------------------
-// Print messages in a thread safe way
-void tsPrint(const std::string & msg, std::thread::id thrId) {
-  auto printLambda = [thrId](std::string msgCopy) {
-    std::cout << "[" << thrId << "] " << msgCopy << "\n";
+// Thread placement. The NUMA topology is read from sysfs; if it is not
+// available all the cpus the process may use are considered to be on node 0.
+struct CpuTopology {
+  std::vector<std::vector<int>> nodeCpus;
+
+  int nodeOf(int cpu) const {
+    for (size_t node = 0; node < nodeCpus.size(); ++node)
+      for (int nodeCpu : nodeCpus[node])
+        if (nodeCpu == cpu)
+          return node;
+    return 0;
   };
-  Action * action = new Action((std::bind(printLambda, msg)));
-  gMsgQueue->push(action);
+};
+
+// Parse a cpu list like "0-3,8,10-11"
+std::vector<int> parseCpuList(const std::string & list) {
+  std::vector<int> cpus;
+  std::istringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty())
+      continue;
+    const size_t dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+CpuTopology readTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  CpuTopology topology;
+  for (int node = 0;; ++node) {
+    std::ifstream cpuList("/sys/devices/system/node/node" +
+                          std::to_string(node) + "/cpulist");
+    if (!cpuList.is_open())
+      break;
+    std::string list;
+    std::getline(cpuList, list);
+    std::vector<int> cpus;
+    for (int cpu : parseCpuList(list))
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    topology.nodeCpus.push_back(cpus);
+  }
+  if (topology.nodeCpus.empty()) {
+    topology.nodeCpus.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &allowed))
+        topology.nodeCpus[0].push_back(cpu);
+  }
+  return topology;
 }
 
+// The cpu of every thread for a policy: "none" (no pinning), "compact" (fill
+// a node before moving to the next), "scatter" (round robin over the nodes)
+// or "cpus:<list>". Returns false if the policy is not understood.
+bool placeThreads(const std::string & policy, const CpuTopology & topology,
+                  int nThreads, std::vector<int> & threadCpus) {
+  std::vector<int> order;
+  if (policy == "none") {
+    threadCpus.assign(nThreads, -1);
+    return true;
+  } else if (policy == "compact") {
+    for (auto & cpus : topology.nodeCpus)
+      order.insert(order.end(), cpus.begin(), cpus.end());
+  } else if (policy == "scatter") {
+    for (size_t i = 0;; ++i) {
+      bool added = false;
+      for (auto & cpus : topology.nodeCpus) {
+        if (i < cpus.size()) {
+          order.push_back(cpus[i]);
+          added = true;
+        }
+      }
+      if (!added)
+        break;
+    }
+  } else if (policy.compare(0, 5, "cpus:") == 0) {
+    order = parseCpuList(policy.substr(5));
+  } else {
+    return false;
+  }
+  if (order.empty())
+    return false;
+  threadCpus.clear();
+  for (int i = 0; i < nThreads; ++i)
+    threadCpus.push_back(order[i % order.size()]);
+  return true;
+}
+
+void pinCurrentThread(int cpu) {
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpu, &cpuSet);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+}
+
+// One work queue per NUMA node in use. A thread pushes the continuations
+// into the queue of its node, and pops from the other queues only when its
+// own is empty.
+std::vector<TsActionPtrQueue *> gNodeQueues;
+thread_local size_t tNode = 0;
+
+TsActionPtrQueue * localQueue() { return gNodeQueues[tNode]; }
+
+//------------------------------------------------------------------------------
+// Print messages in a thread safe way, without slowing down the workers.
+// A producer does not format anything: it appends a fixed size record (which
+// message, and its argument) to its own single producer single consumer ring.
+// The logger thread formats the records of all the rings and writes them in
+// batches. If a ring is full the message is dropped and counted: logging
+// never blocks a worker.
+enum class LogMessage : uint8_t {
+  kStartPulling,
+  kFolded,
+  kStuffed,
+  kSealed,
+  kAddressed,
+  kStamped,
+  kSent
+};
+
+class AsyncLogger {
+public:
+  AsyncLogger(size_t maxProducers)
+      : m_rings(maxProducers), m_nRings(0), m_stop(false){};
+
+  void log(LogMessage message, uint64_t arg = 0) {
+    Ring & ring = threadRing();
+    const size_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == kRingSize) {
+      ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+      return;
+    }
+    ring.records[tail % kRingSize] = {message, arg};
+    ring.tail.store(tail + 1, std::memory_order_release);
+  };
+
+  // Body of the logger thread: runs until stop() is called and all the rings
+  // are drained. It sleeps only when there was nothing to write.
+  void consume(std::ostream & os) {
+    std::string batch;
+    std::chrono::milliseconds sleepDuration(1);
+    while (true) {
+      const bool stopping = m_stop.load(std::memory_order_acquire);
+      const size_t nRings = m_nRings.load(std::memory_order_acquire);
+      size_t nRecords = 0;
+      for (size_t r = 0; r < nRings; ++r)
+        nRecords += drain(m_rings[r], batch);
+      if (!batch.empty()) {
+        os.write(batch.data(), batch.size());
+        os.flush();
+        batch.clear();
+      }
+      if (nRecords == 0) {
+        if (stopping)
+          return;
+        std::this_thread::sleep_for(sleepDuration);
+      }
+    }
+  };
+
+  void stop() { m_stop.store(true, std::memory_order_release); };
+
+  size_t getNdropped() const {
+    size_t dropped = 0;
+    for (size_t r = 0; r < m_nRings.load(std::memory_order_acquire); ++r)
+      dropped += m_rings[r].dropped.load(std::memory_order_relaxed);
+    return dropped;
+  };
+
+private:
+  static constexpr size_t kRingSize = 1024;
+
+  struct Record {
+    LogMessage message;
+    uint64_t arg;
+  };
+
+  struct Ring {
+    alignas(64) std::atomic<size_t> head{0}; // written by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; // written by the producer
+    std::atomic<size_t> dropped{0};
+    std::string label; // "[thread id] "
+    Record records[kRingSize];
+  };
+
+  // Format all the records available in the ring, return how many
+  size_t drain(Ring & ring, std::string & batch) {
+    const size_t head = ring.head.load(std::memory_order_relaxed);
+    const size_t tail = ring.tail.load(std::memory_order_acquire);
+    for (size_t i = head; i < tail; ++i) {
+      const Record & record = ring.records[i % kRingSize];
+      batch += ring.label;
+      if (record.message == LogMessage::kStartPulling) {
+        batch += "Start pulling work\n";
+        continue;
+      }
+      batch += "Mail item ";
+      batch += std::to_string(record.arg);
+      batch += kSuffixes[static_cast<int>(record.message)];
+    }
+    ring.head.store(tail, std::memory_order_release);
+    return tail - head;
+  };
+
+  static constexpr const char * kSuffixes[] = {
+      "",
+      " was folded.\n",
+      " was stuffed.\n",
+      " was sealed.\n",
+      " was addressed.\n",
+      " was stamped.\n",
+      " was sent.\n"};
+
+  // The ring of the calling thread, claimed at its first message
+  Ring & threadRing() {
+    thread_local size_t tRing = claimRing();
+    return m_rings[tRing];
+  };
+  size_t claimRing() {
+    std::lock_guard<std::mutex> lock(m_claimMutex);
+    const size_t myRing = m_nRings.load(std::memory_order_relaxed);
+    if (myRing == m_rings.size()) {
+      std::cerr << "AsyncLogger: more than " << m_rings.size()
+                << " producers\n";
+      std::abort();
+    }
+    std::ostringstream label;
+    label << "[" << std::this_thread::get_id() << "] ";
+    m_rings[myRing].label = label.str();
+    m_nRings.store(myRing + 1, std::memory_order_release);
+    return myRing;
+  };
+
+  std::vector<Ring> m_rings;
+  std::atomic<size_t> m_nRings;
+  std::atomic<bool> m_stop;
+  std::mutex m_claimMutex;
+};
+
+AsyncLogger * gLogger;
+
 //------------------------------------------------------------------------------
-// A dummy function which just spends time crunching CPU
+// A dummy kernel which just spends time crunching CPU. Polling the clock in a
+// tight loop measures mostly the clock itself, so instead we run a fixed
+// number of iterations of either a compute bound (fma) or a memory bound
+// (stream triad) loop. The iterations per second are calibrated once at
+// startup against the steady clock.
 using Duration = std::chrono::duration<float>;
-using TimePoint = std::chrono::time_point<std::chrono::system_clock>;
-
-void doWork(float deltaTf) {
-  Duration deltaT(deltaTf);
-  Duration elapsed_seconds;
-  TimePoint start, end;
-  start = std::chrono::system_clock::now();
-  while (elapsed_seconds < deltaT) {
-    end = std::chrono::system_clock::now();
-    elapsed_seconds = end - start;
+using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+
+class WorkKernel {
+public:
+  enum class Type { kFma, kStream };
+
+  WorkKernel(Type type) : m_type(type), m_iterPerSecond(0.){};
+
+  // Run the kernel with increasing number of iterations until it lasts long
+  // enough to be measured precisely
+  void calibrate() {
+    const Duration minDuration(0.2);
+    size_t nIter = 1024;
+    Duration elapsed(0.);
+    while (elapsed < minDuration) {
+      nIter *= 2;
+      TimePoint start = std::chrono::steady_clock::now();
+      runIterations(nIter);
+      elapsed = std::chrono::steady_clock::now() - start;
+    }
+    m_iterPerSecond = nIter / elapsed.count();
   }
+
+  void run(float deltaTf) const { runIterations(deltaTf * m_iterPerSecond); }
+
+  double getIterPerSecond() const { return m_iterPerSecond; };
+
+  const char * getName() const {
+    return m_type == Type::kFma ? "fma" : "stream";
+  };
+
+private:
+  static constexpr size_t kNchains = 8;
+  static constexpr size_t kStreamSize = 1 << 19; // 3 x 4 MB per thread
+
+  void runIterations(size_t nIter) const {
+    if (m_type == Type::kFma)
+      runFma(nIter);
+    else
+      runStream(nIter);
+  }
+
+  // Independent chains of multiply-adds keep the FMA units busy
+  static void runFma(size_t nIter) {
+    double x[kNchains];
+    for (size_t c = 0; c < kNchains; ++c)
+      x[c] = c;
+    for (size_t i = 0; i < nIter; ++i)
+      for (size_t c = 0; c < kNchains; ++c)
+        x[c] = std::fma(x[c], 0.999999999, 1e-9);
+    double sum = 0.;
+    for (size_t c = 0; c < kNchains; ++c)
+      sum += x[c];
+    tSink = sum;
+  }
+
+  // a = b + s * c over buffers larger than the caches: one iteration is one
+  // element, i.e. 24 bytes of memory traffic
+  static void runStream(size_t nIter) {
+    thread_local std::vector<double> a(kStreamSize, 0.), b(kStreamSize, 1.),
+        c(kStreamSize, 2.);
+    thread_local size_t offset = 0;
+    while (nIter > 0) {
+      const size_t n = std::min(nIter, kStreamSize - offset);
+      for (size_t i = offset; i < offset + n; ++i)
+        a[i] = b[i] + 0.5 * c[i];
+      nIter -= n;
+      offset = (offset + n) % kStreamSize;
+    }
+    tSink = a[offset];
+  }
+
+  // Results are written here so that the compiler cannot drop the loops
+  static thread_local volatile double tSink;
+
+  const Type m_type;
+  double m_iterPerSecond;
+};
+
+thread_local volatile double WorkKernel::tSink = 0.;
+
+WorkKernel * gWorkKernel = nullptr;
+
+//------------------------------------------------------------------------------
+// All the stage durations are multiplied by the MAIL_TIME_SCALE environment
+// variable (default 1), e.g. to benchmark with stages lasting microseconds
+float timeScale() {
+  static const float scale = [] {
+    const char * value = std::getenv("MAIL_TIME_SCALE");
+    return value ? std::stof(value) : 1.f;
+  }();
+  return scale;
 }
 
+void doWork(float deltaTf) { gWorkKernel->run(deltaTf * timeScale()); }
+
 //------------------------------------------------------------------------------
 // Small dummy class representing a mail item. It has an Id and a state
 class mailItem {
@@ -145,8 +483,7 @@ TsQueue<mailItem> * gSentMailItemsQueue;
 void Mail(mailItem & item) {
   doWork(.7);
   item.setState(mailItem::State::kMailed);
-  tsPrint("Mail item " + std::to_string(item.getId()) + " was sent.",
-          std::this_thread::get_id());
+  gLogger->log(LogMessage::kSent, item.getId());
   gSentMailItemsQueue->push(item);
 }
 
@@ -154,68 +491,78 @@ void Stamp(mailItem & item) {
   doWork(.05);
   item.setState(mailItem::State::kStamped);
   Action * work = new Action(std::bind(Mail, item));
-  tsPrint("Mail item " + std::to_string(item.getId()) + " was stamped.",
-          std::this_thread::get_id());
-  gActionsQueue->push(work);
+  gLogger->log(LogMessage::kStamped, item.getId());
+  localQueue()->push(work);
 }
 
 void Address(mailItem & item) {
   doWork(.5);
   item.setState(mailItem::State::kAddressed);
   Action * work = new Action(std::bind(Stamp, item));
-  tsPrint("Mail item " + std::to_string(item.getId()) + " was addressed.",
-          std::this_thread::get_id());
-  gActionsQueue->push(work);
+  gLogger->log(LogMessage::kAddressed, item.getId());
+  localQueue()->push(work);
 }
 
 void Seal(mailItem & item) {
   doWork(.24);
   item.setState(mailItem::State::kSealed);
   Action * work = new Action(std::bind(Address, item));
-  tsPrint("Mail item " + std::to_string(item.getId()) + " was sealed.",
-          std::this_thread::get_id());
-  gActionsQueue->push(work);
+  gLogger->log(LogMessage::kSealed, item.getId());
+  localQueue()->push(work);
 }
 
 void Stuff(mailItem & item) {
   doWork(.1);
   item.setState(mailItem::State::kStuffed);
   Action * work = new Action(std::bind(Seal, item));
-  tsPrint("Mail item " + std::to_string(item.getId()) + " was stuffed.",
-          std::this_thread::get_id());
-  gActionsQueue->push(work);
+  gLogger->log(LogMessage::kStuffed, item.getId());
+  localQueue()->push(work);
 }
 
 void Fold(mailItem & item) {
   doWork(.12);
   item.setState(mailItem::State::kFolded);
-  tsPrint("Mail item " + std::to_string(item.getId()) + " was folded.",
-          std::this_thread::get_id());
+  gLogger->log(LogMessage::kFolded, item.getId());
   Action * work = new Action(std::bind(Stuff, item));
-  gActionsQueue->push(work);
+  localQueue()->push(work);
 }
 
 //------------------------------------------------------------------------------
-// Pull work items from a work queue and stop when necessary
-// It can sleep.
-void pullWork(TsActionPtrQueue * workQueue, std::function<bool()> stopCondition,
-              bool sleep) {
+// Pull work items from the work queues and stop when necessary
+void pullWork(std::function<bool()> stopCondition) {
 
-  std::chrono::milliseconds sleepDuration(10);
   Action * action = nullptr;
-  tsPrint("Start pulling work", std::this_thread::get_id());
-  while (workQueue->try_pop(action) || stopCondition()) {
+  gLogger->log(LogMessage::kStartPulling);
+  while (stopCondition()) {
+    if (!localQueue()->try_pop(action)) {
+      for (size_t i = 1; i < gNodeQueues.size() && !action; ++i)
+        gNodeQueues[(tNode + i) % gNodeQueues.size()]->try_pop(action);
+    }
     if (action) {
       (*action)();
       delete action;
       action = nullptr;
     }
-    if (sleep) {
-      std::this_thread::sleep_for(sleepDuration);
-    }
   }
 }
 
+//------------------------------------------------------------------------------
+// Body of every thread: go to its cpu, create the mail items it is in charge
+// of, so that their memory is first touched on its node, then work.
+void runWorker(int cpu, size_t node, int firstItem, int lastItem,
+               std::function<bool()> stopCondition) {
+  if (cpu >= 0)
+    pinCurrentThread(cpu);
+  tNode = node;
+  std::vector<mailItem> mailItems;
+  mailItems.reserve(lastItem - firstItem);
+  for (int i = firstItem; i < lastItem; ++i)
+    mailItems.emplace_back(i);
+  for (auto & mailItem : mailItems)
+    localQueue()->push(new Action(std::bind(Fold, mailItem)));
+  pullWork(stopCondition);
+}
+
 //------------------------------------------------------------------------------
 
 std::vector<size_t> gCompletedMailItemIDs;
@@ -224,19 +571,35 @@ int main(int argc, char ** argv) {
 
   // Get the arguments from command line and notify start
   // Parse args
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <mail items> <n working threads>\n";
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads> [fma|stream]"
+                 " [none|compact|scatter|cpus:<list>]\n";
     return 1;
   }
 
   int nItems = std::stoi(argv[1]);
   int nThreads = std::stoi(argv[2]);
+  std::string kernelName = argc > 3 ? argv[3] : "fma";
+  std::string affinityPolicy = argc > 4 ? argv[4] : "none";
+
+  CpuTopology topology = readTopology();
+  std::vector<int> threadCpus;
 
-  if (nItems * nThreads == 0) {
+  if (nItems <= 0 || nThreads <= 0 ||
+      (kernelName != "fma" && kernelName != "stream") ||
+      !placeThreads(affinityPolicy, topology, nThreads, threadCpus)) {
     std::cerr << "Invalid input parameter(s) value(s)\n";
     return 1;
   }
 
+  WorkKernel workKernel(kernelName == "fma" ? WorkKernel::Type::kFma
+                                            : WorkKernel::Type::kStream);
+  workKernel.calibrate();
+  gWorkKernel = &workKernel;
+  std::cout << "Calibrated " << workKernel.getName() << " kernel: "
+            << workKernel.getIterPerSecond() << " iterations/s\n";
+
   gSentMailItemsQueue = new TsQueue<mailItem>(nItems);
 
   std::cout << "Starting with " << nItems << " items and " << nThreads
@@ -245,53 +608,72 @@ int main(int argc, char ** argv) {
 
   // Here the real orchestration starts!
 
-  // We need a common signal when to stop
-  bool workEnded = false;
-
-  // Create a svc thread for logging. This one sleeps:
+  // Create a svc thread for logging. This one sleeps when idle:
   // we do not need a full core for logging!
-  std::thread msgSvcThr(
-      pullWork, gMsgQueue, [&workEnded] { return !workEnded; }, true);
+  AsyncLogger logger(nThreads);
+  gLogger = &logger;
+  std::thread msgSvcThr(&AsyncLogger::consume, &logger, std::ref(std::cout));
 
   // Condition to stop pulling work from queue
   auto stopPullingWork([] { return !gSentMailItemsQueue->isFull(); });
 
-  // Launch worker threads
-  std::vector<std::thread> workerThreads;
-  for (int i = 0; i < nThreads - 1; ++i) { // 1 thread is the main thread :)
-    workerThreads.emplace_back(pullWork, gActionsQueue, stopPullingWork, false);
-    std::cout << "Worker thread " << i << " created\n";
+  // Place the threads and create one queue per node in use. An item has at
+  // most one action queued at a time, and the actions of any item can end up
+  // in any queue: a queue of nItems entries never fills up, so the threads
+  // can pump their whole share before they start pulling.
+  std::vector<size_t> threadNodes;
+  std::vector<size_t> nodeIndex(topology.nodeCpus.size(), SIZE_MAX);
+  for (int cpu : threadCpus) {
+    const size_t node = cpu < 0 ? 0 : topology.nodeOf(cpu);
+    if (nodeIndex[node] == SIZE_MAX) {
+      nodeIndex[node] = gNodeQueues.size();
+      gNodeQueues.push_back(new TsActionPtrQueue(nItems));
+    }
+    threadNodes.push_back(nodeIndex[node]);
   }
+  std::cout << "Using " << gNodeQueues.size() << " work queue(s)\n";
 
-  // Create the mail items (this thread owns them)
-  std::vector<mailItem> mailItems;
-  mailItems.reserve(nItems);
-  for (int i = 0; i < nItems; ++i)
-    mailItems.emplace_back(i);
+  // The items are created and pumped by the threads, in equal shares
+  auto firstItem = [nItems, nThreads](int thread) {
+    return static_cast<int>(static_cast<long>(nItems) * thread / nThreads);
+  };
+
+  auto start = std::chrono::steady_clock::now();
 
-  // Pump the work into the work queue
-  std::cout << "Adding initial work items to queue...\n";
-  Action * action;
-  for (auto & mailItem : mailItems) {
-    action = new Action(std::bind(Fold, mailItem));
-    gActionsQueue->push(action);
+  // Launch worker threads
+  std::vector<std::thread> workerThreads;
+  for (int i = 1; i < nThreads; ++i) { // 1 thread is the main thread :)
+    workerThreads.emplace_back(runWorker, threadCpus[i], threadNodes[i],
+                               firstItem(i), firstItem(i + 1),
+                               stopPullingWork);
+    std::cout << "Worker thread " << i - 1 << " created";
+    if (threadCpus[i] >= 0)
+      std::cout << " on cpu " << threadCpus[i];
+    std::cout << "\n";
   }
 
   // transform the main thread in a worker
-  pullWork(gActionsQueue, stopPullingWork, false);
+  runWorker(threadCpus[0], threadNodes[0], firstItem(0), firstItem(1),
+            stopPullingWork);
 
   // Join threads
   for (auto & thr : workerThreads) // 1 thread is the main thread :)
     thr.join();
 
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
   // no more work, let's join the logger thread
-  workEnded = true;
+  logger.stop();
   msgSvcThr.join();
 
   // clean up
-  delete gActionsQueue;
-  delete gMsgQueue;
+  for (auto queue : gNodeQueues)
+    delete queue;
   delete gSentMailItemsQueue;
 
-  std::cout << "Work finished, threads joined\n";
+  std::cout << "Work finished, threads joined\n"
+            << "Elapsed time: " << elapsed.count() << " s, throughput "
+            << nItems / elapsed.count() << " items/s\n"
+            << "Log messages dropped: " << logger.getNdropped() << "\n";
 }
@@ -0,0 +1,343 @@
+/* Discrete-event simulation of the mail item pipeline on a virtual clock
+g++ mailItemSimulation.cpp -o mailItemSimulation -std=c++17 -fgnu-tm -pthread
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemSimulation <mail items> <n working threads> [seed] [time scale]
+
+The stage costs and the thread count are the ones of mailItemBetterDesign, but
+no thread ever sleeps: a virtual clock jumps from one stage completion to the
+next: 1M items on 256 workers are simulated in 5 to 8 s built as above, or
+in about a second with -O2.
+The cost of every stage of every item is a pure function of (seed, item,
+stage), therefore two runs with the same seed give exactly the same result.
+If a time scale is given (e.g. 0.001), a real multi-threaded run sleeping
+scale * cost for each stage is performed as well and its makespan is compared
+with the prediction.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+// The stages of the mail item state machine, with their mean cost in seconds.
+// Same numbers as in MailItem::next() of mailItemBetterDesign.cpp
+struct Stage {
+  const char * name;
+  double meanCost;
+};
+
+constexpr int kNstages = 6;
+const Stage gStages[kNstages] = {{"folding", 0.12},   {"stuffing", 0.1},
+                                 {"sealing", 0.24},   {"addressing", 0.5},
+                                 {"stamping", 0.05},  {"mailing", 0.7}};
+
+//------------------------------------------------------------------------------
+// Counter based random numbers: the cost of a stage does not depend on the
+// order in which the stages are executed, only on the seed, item and stage.
+uint64_t splitmix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+constexpr double kPi = 3.14159265358979323846;
+
+double toUniform(uint64_t x) { return ((x >> 11) + 0.5) * 0x1.0p-53; }
+
+// |N(mean, 0.4 * mean)|, as the jitter of mailItemBetterDesign
+double stageCost(uint64_t seed, size_t item, int stage) {
+  const uint64_t key = splitmix64(seed ^ splitmix64(item * kNstages + stage));
+  const double u1 = toUniform(key);
+  const double u2 = toUniform(splitmix64(key));
+  const double gauss =
+      std::sqrt(-2. * std::log(u1)) * std::cos(2. * kPi * u2);
+  const double mean = gStages[stage].meanCost;
+  return std::fabs(mean + mean * .4 * gauss);
+}
+
+//------------------------------------------------------------------------------
+// A unit of work: apply stage 'stage' to the item 'item'
+struct Task {
+  size_t item;
+  int stage;
+};
+
+//------------------------------------------------------------------------------
+// Result of a simulated or real run
+struct RunStats {
+  double makespan = 0.;
+  std::vector<double> workerBusy;
+  double meanQueueDepth = 0.;
+  size_t maxQueueDepth = 0;
+  double meanWaiting[kNstages] = {};
+  size_t events = 0;
+};
+
+//------------------------------------------------------------------------------
+// The simulation. Like in the threaded programs all the items are pumped into
+// a LIFO work queue, then every worker pops a task, spends the stage cost on
+// it and pushes the continuation back. Pumping is modelled as instantaneous
+// and pushes never block, so the maximum depth reported tells how large the
+// work queue has to be.
+RunStats simulate(size_t nItems, int nWorkers, uint64_t seed) {
+  RunStats stats;
+  stats.workerBusy.assign(nWorkers, 0.);
+
+  std::vector<Task> workQueue;
+  workQueue.reserve(nItems);
+  size_t waiting[kNstages] = {};
+  for (size_t i = nItems; i > 0; --i) // item 0 on top, as in the real pump
+    workQueue.push_back({i - 1, 0});
+  waiting[0] = nItems;
+  stats.maxQueueDepth = nItems;
+
+  // completion events: (virtual time, worker)
+  using Event = std::pair<double, int>;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+  std::vector<Task> running(nWorkers);
+  std::vector<int> idleWorkers;
+
+  double now = 0.;
+  double depthIntegral = 0.;
+  double waitingIntegral[kNstages] = {};
+
+  auto startTask = [&](int worker) {
+    const Task task = workQueue.back();
+    workQueue.pop_back();
+    --waiting[task.stage];
+    running[worker] = task;
+    const double cost = stageCost(seed, task.item, task.stage);
+    stats.workerBusy[worker] += cost;
+    events.emplace(now + cost, worker);
+  };
+
+  for (int w = 0; w < nWorkers; ++w) {
+    if (workQueue.empty())
+      idleWorkers.push_back(w);
+    else
+      startTask(w);
+  }
+
+  while (!events.empty()) {
+    const Event event = events.top();
+    events.pop();
+    // integrate the queue depths up to this event
+    const double dt = event.first - now;
+    depthIntegral += dt * workQueue.size();
+    for (int s = 0; s < kNstages; ++s)
+      waitingIntegral[s] += dt * waiting[s];
+    now = event.first;
+    ++stats.events;
+
+    const int worker = event.second;
+    const Task & done = running[worker];
+    if (done.stage + 1 < kNstages) {
+      workQueue.push_back({done.item, done.stage + 1});
+      ++waiting[done.stage + 1];
+      if (workQueue.size() > stats.maxQueueDepth)
+        stats.maxQueueDepth = workQueue.size();
+    }
+    idleWorkers.push_back(worker);
+    while (!idleWorkers.empty() && !workQueue.empty()) {
+      const int next = idleWorkers.back();
+      idleWorkers.pop_back();
+      startTask(next);
+    }
+  }
+
+  stats.makespan = now;
+  if (now > 0.) {
+    stats.meanQueueDepth = depthIntegral / now;
+    for (int s = 0; s < kNstages; ++s)
+      stats.meanWaiting[s] = waitingIntegral[s] / now;
+  }
+  return stats;
+}
+
+//------------------------------------------------------------------------------
+// Put the first stage of every item in the work queue, item 0 on top
+void pumpItems(TsQueue<Task> & workQueue, size_t nItems) {
+  for (size_t i = nItems; i > 0; --i)
+    workQueue.push({i - 1, 0});
+}
+
+//------------------------------------------------------------------------------
+// The real thing, with the same costs scaled by timeScale. Only the makespan
+// is measured here.
+double realRun(size_t nItems, int nThreads, uint64_t seed, double timeScale) {
+  TsQueue<Task> workQueue(nItems);
+  pumpItems(workQueue, nItems);
+
+  size_t nMailed = 0;
+  auto getNmailed = [&nMailed] {
+    size_t n = 0;
+    __transaction_atomic { n = nMailed; }
+    return n;
+  };
+
+  auto pullWork = [&] {
+    Task task;
+    while (getNmailed() < nItems) {
+      if (!workQueue.try_pop(task))
+        continue;
+      std::this_thread::sleep_for(std::chrono::duration<double>(
+          timeScale * stageCost(seed, task.item, task.stage)));
+      if (task.stage + 1 < kNstages) {
+        workQueue.push({task.item, task.stage + 1});
+      } else {
+        __transaction_atomic { ++nMailed; }
+      }
+    }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(pullWork);
+  pullWork();
+  for (auto & thr : workerThreads)
+    thr.join();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / timeScale;
+}
+
+//------------------------------------------------------------------------------
+void printStats(const RunStats & stats, size_t nItems) {
+  double busyTot = 0.;
+  double busyMin = stats.workerBusy.front();
+  double busyMax = busyMin;
+  for (auto busy : stats.workerBusy) {
+    busyTot += busy;
+    busyMin = std::min(busyMin, busy);
+    busyMax = std::max(busyMax, busy);
+  }
+  const double nWorkers = stats.workerBusy.size();
+  const double toPercent = stats.makespan > 0. ? 100. / stats.makespan : 0.;
+
+  std::cout << "Makespan:            " << stats.makespan << " s\n"
+            << "Throughput:          " << nItems / stats.makespan
+            << " items/s\n"
+            << "Worker utilization:  mean " << busyTot / nWorkers * toPercent
+            << "% min " << busyMin * toPercent << "% max "
+            << busyMax * toPercent << "%\n"
+            << "Work queue depth:    mean " << stats.meanQueueDepth << " max "
+            << stats.maxQueueDepth << "\n"
+            << "Mean tasks waiting per stage:\n";
+  for (int s = 0; s < kNstages; ++s) {
+    std::cout << "  " << gStages[s].name << ": " << stats.meanWaiting[s]
+              << "\n";
+  }
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads> [seed] [time scale]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  uint64_t seed = argc > 3 ? std::stoull(argv[3]) : 42;
+  double timeScale = argc > 4 ? std::stod(argv[4]) : 0.;
+
+  if (nItems <= 0 || nThreads <= 0 || timeScale < 0.) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << "Simulating " << nItems << " items and " << nThreads
+            << " threads with seed " << seed << "\n";
+
+  const auto start = std::chrono::steady_clock::now();
+  RunStats stats = simulate(nItems, nThreads, seed);
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printStats(stats, nItems);
+  std::cout << "Simulated " << stats.events << " events in " << elapsed.count()
+            << " s of wall time\n";
+
+  if (timeScale > 0.) {
+    std::cout << "Cross-checking with a real run, time scale " << timeScale
+              << "\n";
+    const double measured = realRun(nItems, nThreads, seed, timeScale);
+    std::cout << "Measured makespan:   " << measured << " s (rescaled)\n"
+              << "Deviation:           "
+              << 100. * (measured - stats.makespan) / stats.makespan << "%\n";
+  }
+}
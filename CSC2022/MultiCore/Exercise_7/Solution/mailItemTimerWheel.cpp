@@ -0,0 +1,352 @@
+/* Mail item processing with a hierarchical timer wheel
+g++ mailItemTimerWheel.cpp -o mailItemTimerWheel -std=c++17 -fgnu-tm -pthread
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: mailItemTimerWheel <mail items> <n working threads> [time scale]
+                          [in-flight limits]
+e.g.   mailItemTimerWheel 2000 8 0.01 1,8,64,512,4096
+
+In mailItemBetterDesign a stage sleeps in the worker thread for its whole
+duration, so there are never more items in flight than threads. Here a stage
+which waits (for a device, for I/O) registers a wakeup in a timer wheel and
+returns: the worker is free at once, and the continuation of the item is
+queued when the timer fires. The wheel has no thread of its own: the workers
+advance it between two actions, one of them at a time.
+Both designs are run with at most 'limit' items admitted at once, for every
+in-flight limit (default 1,8,64,512,4096), and the throughput is printed
+with the mean number of items actually in flight (Little's law). The stage
+durations are the ones of MailItem::next() times the time scale (default
+0.01).
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+
+template <class T> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Action = std::function<void()>;
+using Duration = std::chrono::duration<float>;
+
+using TsActionPtrQueue = TsQueue<Action *>;
+using Clock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+// Hierarchical timer wheel. Level 0 has one slot per tick, level l one slot
+// per 64^l ticks: a timer goes to the level which covers its remaining delay,
+// and moves down ("cascades") each time the level below has turned once.
+// Scheduling and expiring are O(1) whatever the number of pending timers.
+class TimerWheel {
+public:
+  TimerWheel(Duration tick)
+      : m_tick(std::chrono::duration_cast<Clock::duration>(tick)),
+        m_start(Clock::now()), m_now(0), m_nPending(0){};
+  //---------
+  // The action will be queued once the delay has elapsed
+  void schedule(Duration delay, Action * action) {
+    const uint64_t ticks =
+        std::max<uint64_t>(1, std::ceil(delay / Duration(m_tick)));
+    std::lock_guard<std::mutex> lock(m_mutex);
+    insert({m_now.load(std::memory_order_relaxed) + ticks, action});
+    m_nPending.fetch_add(1);
+  };
+  //---------
+  // Advance the wheel to the current time and push the actions of the
+  // expired timers into the queue. One thread advances the wheel at a time:
+  // the others return at once. Returns the number of timers fired.
+  size_t poll(TsActionPtrQueue & queue) {
+    const uint64_t target = (Clock::now() - m_start) / m_tick;
+    if (target <= m_now.load(std::memory_order_acquire))
+      return 0;
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+      return 0;
+    m_fired.clear();
+    while (m_now.load(std::memory_order_relaxed) < target)
+      advance();
+    std::vector<Action *> fired;
+    fired.swap(m_fired);
+    lock.unlock();
+    for (auto action : fired)
+      queue.push(action);
+    m_nPending.fetch_sub(fired.size());
+    return fired.size();
+  };
+  //---------
+  size_t getNpending() { return m_nPending.load(); };
+  //---------
+  Clock::time_point nextTick() {
+    return m_start + (m_now.load(std::memory_order_relaxed) + 1) * m_tick;
+  };
+
+private:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 6;
+  static constexpr uint64_t kSlots = uint64_t(1) << kSlotBits;
+  static constexpr uint64_t kMask = kSlots - 1;
+
+  struct Timer {
+    uint64_t expiry; // in ticks
+    Action * action;
+  };
+
+  void insert(const Timer & timer) {
+    const uint64_t now = m_now.load(std::memory_order_relaxed);
+    uint64_t expiry = std::max(timer.expiry, now);
+    int level = 0;
+    while (level < kLevels - 1 &&
+           (expiry - now) >> (kSlotBits * (level + 1)) != 0)
+      ++level;
+    // beyond the range of the wheel: park in the last slot of the top level,
+    // the timer is placed again when that slot cascades
+    const uint64_t range = uint64_t(1) << (kSlotBits * kLevels);
+    if (expiry - now >= range)
+      expiry = now + range - 1;
+    m_slots[level][(expiry >> (kSlotBits * level)) & kMask].push_back(timer);
+  };
+
+  // Move to the next tick: cascade the levels whose lower level has turned,
+  // then expire the slot of the tick
+  void advance() {
+    const uint64_t now = m_now.load(std::memory_order_relaxed) + 1;
+    m_now.store(now, std::memory_order_release);
+    int level = 1;
+    while (level < kLevels &&
+           (now & ((uint64_t(1) << (kSlotBits * level)) - 1)) == 0)
+      ++level;
+    for (int l = level - 1; l >= 1; --l) {
+      std::vector<Timer> timers;
+      timers.swap(m_slots[l][(now >> (kSlotBits * l)) & kMask]);
+      for (auto & timer : timers)
+        insert(timer);
+    }
+    auto & slot = m_slots[0][now & kMask];
+    for (auto & timer : slot)
+      m_fired.push_back(timer.action);
+    slot.clear();
+  };
+
+  const Clock::duration m_tick;
+  const Clock::time_point m_start;
+  std::mutex m_mutex;
+  std::atomic<uint64_t> m_now; // last tick processed, written under m_mutex
+  std::atomic<size_t> m_nPending;
+  std::vector<Timer> m_slots[kLevels][kSlots];
+  std::vector<Action *> m_fired;
+};
+
+//------------------------------------------------------------------------------
+// Durations of the stages of MailItem::next() in mailItemBetterDesign
+constexpr int kNstages = 6;
+const float gStageDurations[kNstages] = {0.12f, 0.1f, 0.24f,
+                                         0.5f,  0.05f, 0.7f};
+
+//------------------------------------------------------------------------------
+// What the actions of one run share
+struct Pipeline {
+  Pipeline(size_t items, float scale,
+           void (*startStage)(int, Clock::time_point, Pipeline *))
+      : nItems(items), timeScale(scale), start(startStage),
+        queue(items + 1000), wheel(Duration(1e-4f)){};
+  const size_t nItems;
+  const float timeScale;
+  void (*const start)(int, Clock::time_point, Pipeline *);
+  TsActionPtrQueue queue;
+  TimerWheel wheel;
+  std::atomic<size_t> nAdmitted{0};
+  std::atomic<size_t> nMailed{0};
+  std::atomic<uint64_t> latencyNs{0}; // sum over the mailed items
+};
+
+//------------------------------------------------------------------------------
+// Let one more item in, if any is left
+void admitNext(Pipeline * p) {
+  if (p->nAdmitted.fetch_add(1) < p->nItems)
+    p->queue.push(new Action(std::bind(p->start, 0, Clock::now(), p)));
+}
+
+void finish(Clock::time_point admitted, Pipeline * p) {
+  p->latencyNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             Clock::now() - admitted)
+                             .count());
+  p->nMailed.fetch_add(1, std::memory_order_release);
+  admitNext(p);
+}
+
+//------------------------------------------------------------------------------
+// As in mailItemBetterDesign: the worker sleeps during the stage, then queues
+// the next one
+void doMailBlocking(int stage, Clock::time_point admitted, Pipeline * p) {
+  std::this_thread::sleep_for(Duration(gStageDurations[stage] * p->timeScale));
+  if (stage + 1 < kNstages)
+    p->queue.push(
+        new Action(std::bind(doMailBlocking, stage + 1, admitted, p)));
+  else
+    finish(admitted, p);
+}
+
+// With the timer wheel: the stage registers its wakeup and returns, and the
+// next stage starts when the timer fires
+void doMailTimed(int stage, Clock::time_point admitted, Pipeline * p) {
+  if (stage == kNstages) {
+    finish(admitted, p);
+    return;
+  }
+  p->wheel.schedule(
+      Duration(gStageDurations[stage] * p->timeScale),
+      new Action(std::bind(doMailTimed, stage + 1, admitted, p)));
+}
+
+//------------------------------------------------------------------------------
+void pullWork(Pipeline * p) {
+  Action * action = nullptr;
+  while (p->nMailed.load(std::memory_order_acquire) < p->nItems) {
+    p->wheel.poll(p->queue);
+    if (p->queue.try_pop(action)) {
+      (*action)();
+      delete action;
+    } else if (p->wheel.getNpending() > 0) {
+      std::this_thread::sleep_until(p->wheel.nextTick());
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Run all the items with at most 'limit' admitted at once, print the results
+void run(const char * design, size_t nItems, int nThreads, float timeScale,
+         size_t limit) {
+  const bool timed = std::string(design) == "timer wheel";
+  Pipeline pipeline(nItems, timeScale, timed ? doMailTimed : doMailBlocking);
+  for (size_t i = 0; i < std::min(limit, nItems); ++i)
+    admitNext(&pipeline);
+
+  auto start = Clock::now();
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(pullWork, &pipeline);
+  pullWork(&pipeline);
+  for (auto & thr : workerThreads)
+    thr.join();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  // Little's law: mean number in flight = total time in flight / makespan
+  const double totalLatency = pipeline.latencyNs.load() * 1e-9;
+  std::cout << std::setw(12) << design << std::setw(10) << limit
+            << std::setw(12) << elapsed.count() << std::setw(14)
+            << nItems / elapsed.count() << std::setw(18)
+            << 1e3 * totalLatency / nItems << std::setw(12)
+            << totalLatency / elapsed.count() << "\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads> [time scale]"
+                 " [in-flight limits]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  float timeScale = argc > 3 ? std::stof(argv[3]) : 0.01f;
+  std::vector<size_t> limits;
+  std::istringstream limitList(argc > 4 ? argv[4] : "1,8,64,512,4096");
+  std::string limit;
+  while (std::getline(limitList, limit, ','))
+    limits.push_back(std::stoul(limit));
+
+  if (nItems <= 0 || nThreads <= 0 || timeScale < 0.f || limits.empty() ||
+      std::count(limits.begin(), limits.end(), 0)) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << "Starting with " << nItems << " items and " << nThreads
+            << " threads, time scale " << timeScale << "\n"
+            << std::setw(12) << "design" << std::setw(10) << "limit"
+            << std::setw(12) << "time [s]" << std::setw(14) << "items/s"
+            << std::setw(18) << "latency [ms]" << std::setw(12) << "in flight"
+            << "\n";
+  for (size_t limit : limits) {
+    run("blocking", nItems, nThreads, timeScale, limit);
+    run("timer wheel", nItems, nThreads, timeScale, limit);
+  }
+  std::cout << "Work finished, threads joined\n";
+}
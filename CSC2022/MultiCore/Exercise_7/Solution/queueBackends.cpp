@@ -0,0 +1,589 @@
+/* The thread safe queue with pluggable synchronization backends
+g++ queueBackends.cpp -o queueBackends -std=c++17 -fgnu-tm -pthread -Wall
+-Wextra -Wpedantic -Werror
+
+Usage: queueBackends <mail items> <n working threads> [time scale]
+                     [tm,mutex,ticket,mcs,array]
+e.g.   queueBackends 100000 8 0 tm,mutex,mcs
+
+TsQueue<T, Sync> is the bounded queue of the solutions with the
+synchronization taken out into a policy:
+  tm:       __transaction_atomic, as in mailItemBetterDesign
+  mutex:    std::mutex
+  ticket:   ticket spinlock, FIFO
+  mcs:      MCS queue lock, every waiter spins on its own cache line
+  array:    non-blocking array queue (not strictly lock-free), the slots are
+            claimed with a CAS (this one is FIFO, the others are LIFO like
+            the original)
+Every policy counts the acquisitions, the spin iterations and the time spent
+waiting for the lock; the queue counts the failed try_push and try_pop. An
+acquisition is one try_push or try_pop, whether it succeeds or not: an entry
+into the critical section for the locks and the transaction, a claim attempt
+for the array queue. So for every backend the acquisitions minus the failed
+push and pop are the 12 operations of every item. The
+retries of a transaction are handled by libitm and are invisible here, so
+the tm backend has no spin nor waiting figures.
+The array queue is Vyukov's bounded MPMC queue: a thread preempted between
+claiming a slot and publishing it blocks the next thread that needs that
+cell, so it is not lock-free. The queue has more slots than items, so it is
+never full: its failed push are all cells still held by a consumer of the
+previous round, and its failed pop are an empty queue or a cell not yet
+published by a preempted producer.
+The mail pipeline of mailItemBetterDesign (one Action per stage, the stages
+sleeping their duration times the time scale, default 0 i.e. pure queue
+traffic) is run with each backend and its contention profile is printed.
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Every living thread owns one slot index in the counters. The index is given
+// back when the thread ends, so that any number of short lived threads can be
+// served.
+constexpr size_t kMaxThreads = 256;
+
+std::mutex gSlotMutex;
+std::vector<size_t> gFreeSlots;
+std::atomic<size_t> gNslots{0}; // high water mark, read without the mutex
+
+struct SlotId {
+  SlotId() {
+    std::lock_guard<std::mutex> lock(gSlotMutex);
+    if (!gFreeSlots.empty()) {
+      id = gFreeSlots.back();
+      gFreeSlots.pop_back();
+      return;
+    }
+    id = gNslots.load(std::memory_order_relaxed);
+    if (id == kMaxThreads) {
+      std::cerr << "More than " << kMaxThreads << " threads\n";
+      std::abort();
+    }
+    gNslots.store(id + 1, std::memory_order_release);
+  };
+  ~SlotId() {
+    std::lock_guard<std::mutex> lock(gSlotMutex);
+    gFreeSlots.push_back(id);
+  };
+  size_t id;
+};
+
+thread_local SlotId tSlot;
+
+//------------------------------------------------------------------------------
+// Contention counters. Each thread counts in its own padded slot, so that the
+// counting does not add contention of its own; the slots are summed on read.
+class SyncStats {
+public:
+  enum Counter {
+    kAcquisitions,
+    kFailedPush,
+    kFailedPop,
+    kSpins,
+    kWaitNs,
+    kNcounters
+  };
+  //---------
+  void add(Counter counter, uint64_t n = 1) {
+    auto & value = m_slots[tSlot.id].counters[counter];
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  };
+  //---------
+  uint64_t get(Counter counter) {
+    uint64_t sum = 0;
+    const size_t nSlots = gNslots.load(std::memory_order_acquire);
+    for (size_t i = 0; i < nSlots; ++i)
+      sum += m_slots[i].counters[counter].load(std::memory_order_relaxed);
+    return sum;
+  };
+
+private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> counters[kNcounters] = {};
+  };
+  Slot m_slots[kMaxThreads];
+};
+
+//------------------------------------------------------------------------------
+// Helpers of the spinning policies
+using Clock = std::chrono::steady_clock;
+
+inline uint64_t nanosecondsSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start)
+      .count();
+}
+
+// Spin politely: the holder of the lock may have been descheduled, in which
+// case spinning longer only delays it
+inline void spinWait(uint64_t spins) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+  if (spins % 64 == 0)
+    std::this_thread::yield();
+}
+
+//------------------------------------------------------------------------------
+// The synchronization policies: run(f) executes f() atomically with respect
+// to the other calls of run() on the same policy object, and returns f().
+struct TmSync {
+  static constexpr const char * kName = "tm";
+  template <class F> bool run(F && criticalSection) {
+    bool result = false;
+    __transaction_atomic { result = criticalSection(); }
+    m_stats.add(SyncStats::kAcquisitions);
+    return result;
+  }
+  SyncStats m_stats;
+};
+
+//------------------------------------------------------------------------------
+struct MutexSync {
+  static constexpr const char * kName = "mutex";
+  template <class F> bool run(F && criticalSection) {
+    if (!m_mutex.try_lock()) {
+      auto start = Clock::now();
+      m_mutex.lock();
+      m_stats.add(SyncStats::kWaitNs, nanosecondsSince(start));
+    }
+    m_stats.add(SyncStats::kAcquisitions);
+    const bool result = criticalSection();
+    m_mutex.unlock();
+    return result;
+  }
+  std::mutex m_mutex;
+  SyncStats m_stats;
+};
+
+//------------------------------------------------------------------------------
+// Ticket lock: the threads are served in the order in which they arrived
+struct TicketSync {
+  static constexpr const char * kName = "ticket";
+  template <class F> bool run(F && criticalSection) {
+    const uint32_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+    if (m_serving.load(std::memory_order_acquire) != ticket) {
+      auto start = Clock::now();
+      uint64_t spins = 0;
+      while (m_serving.load(std::memory_order_acquire) != ticket)
+        spinWait(++spins);
+      m_stats.add(SyncStats::kSpins, spins);
+      m_stats.add(SyncStats::kWaitNs, nanosecondsSince(start));
+    }
+    m_stats.add(SyncStats::kAcquisitions);
+    const bool result = criticalSection();
+    m_serving.store(ticket + 1, std::memory_order_release);
+    return result;
+  }
+  alignas(64) std::atomic<uint32_t> m_next{0};
+  alignas(64) std::atomic<uint32_t> m_serving{0};
+  SyncStats m_stats;
+};
+
+//------------------------------------------------------------------------------
+// MCS lock: the waiters form a queue, and each spins on its own node, which
+// lives on its stack, instead of on the lock word
+struct McsSync {
+  static constexpr const char * kName = "mcs";
+  struct alignas(64) Node {
+    std::atomic<Node *> next{nullptr};
+    std::atomic<bool> locked{true};
+  };
+  template <class F> bool run(F && criticalSection) {
+    Node node;
+    Node * previous = m_tail.exchange(&node, std::memory_order_acq_rel);
+    if (previous) {
+      auto start = Clock::now();
+      uint64_t spins = 0;
+      previous->next.store(&node, std::memory_order_release);
+      while (node.locked.load(std::memory_order_acquire))
+        spinWait(++spins);
+      m_stats.add(SyncStats::kSpins, spins);
+      m_stats.add(SyncStats::kWaitNs, nanosecondsSince(start));
+    }
+    m_stats.add(SyncStats::kAcquisitions);
+    const bool result = criticalSection();
+
+    // Hand over to the next waiter, or free the lock if there is none
+    Node * next = node.next.load(std::memory_order_acquire);
+    if (!next) {
+      Node * expected = &node;
+      if (m_tail.compare_exchange_strong(expected, nullptr,
+                                         std::memory_order_acq_rel))
+        return result;
+      uint64_t spins = 0;
+      while (!(next = node.next.load(std::memory_order_acquire)))
+        spinWait(++spins); // a waiter is linking itself
+    }
+    next->locked.store(false, std::memory_order_release);
+    return result;
+  }
+  std::atomic<Node *> m_tail{nullptr};
+  SyncStats m_stats;
+};
+
+//------------------------------------------------------------------------------
+// Tag of the array queue backend, see the specialization of TsQueue below
+struct ArraySync {
+  static constexpr const char * kName = "array";
+  SyncStats m_stats;
+};
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue, with the
+// synchronization given by the policy Sync
+
+template <class T, class Sync> class TsQueue {
+public:
+  TsQueue(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  size_t getNitems() {
+    size_t currentSize = 0;
+    m_sync.run([&] {
+      currentSize = m_currentSize;
+      return true;
+    });
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    const bool success = m_sync.run([&] {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        return true;
+      }
+      return false;
+    });
+    if (!success)
+      m_sync.m_stats.add(SyncStats::kFailedPush);
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    const bool success = m_sync.run([&] {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        return true;
+      }
+      return false;
+    });
+    if (!success)
+      m_sync.m_stats.add(SyncStats::kFailedPop);
+    return success;
+  };
+  //---------
+  SyncStats & getStats() { return m_sync.m_stats; };
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+  Sync m_sync;
+};
+
+//------------------------------------------------------------------------------
+// Non-blocking bounded queue (D. Vyukov's MPMC array queue). Every cell
+// carries a sequence number telling whether it is ready to be written or read
+// for a given position; producers and consumers claim positions with a CAS and
+// never wait for each other, except for the cell they claimed. Not strictly
+// lock-free: a thread stopped between the CAS and the sequence store holds
+// its cell, and the threads reaching that cell a round later fail until it
+// resumes.
+template <class T> class TsQueue<T, ArraySync> {
+public:
+  TsQueue(size_t queueSize) : m_maxSize(queueSize), m_cells(m_maxSize) {
+    for (size_t i = 0; i < m_maxSize; ++i)
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+  };
+  //---------
+  size_t getNitems() {
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  };
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    Cell * cell = claim(m_tail, 0, SyncStats::kFailedPush);
+    if (!cell)
+      return false;
+    cell->item = item;
+    cell->sequence.store(m_position + 1, std::memory_order_release);
+    return true;
+  };
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    Cell * cell = claim(m_head, 1, SyncStats::kFailedPop);
+    if (!cell)
+      return false;
+    item = cell->item;
+    cell->sequence.store(m_position + m_maxSize, std::memory_order_release);
+    return true;
+  };
+  //---------
+  SyncStats & getStats() { return m_sync.m_stats; };
+
+private:
+  struct alignas(64) Cell {
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  // Claim the next position of 'end' (tail for a push, head for a pop): the
+  // cell is ready when its sequence is position + offset. Every call counts
+  // as an acquisition, as a try_push or try_pop of the other backends does.
+  Cell * claim(std::atomic<size_t> & end, size_t offset,
+               SyncStats::Counter failure) {
+    m_sync.m_stats.add(SyncStats::kAcquisitions);
+    size_t position = end.load(std::memory_order_relaxed);
+    uint64_t spins = 0;
+    Clock::time_point start;
+    while (true) {
+      Cell & cell = m_cells[position % m_maxSize];
+      const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      const intptr_t difference =
+          intptr_t(sequence) - intptr_t(position + offset);
+      if (difference == 0) {
+        if (end.compare_exchange_weak(position, position + 1,
+                                      std::memory_order_relaxed))
+          break;
+      } else if (difference < 0) {
+        // empty, full, or the cell of the previous round is still being
+        // read (written) by a consumer (producer) which was preempted
+        m_sync.m_stats.add(failure);
+        record(spins, start);
+        return nullptr;
+      } else {
+        position = end.load(std::memory_order_relaxed);
+      }
+      if (spins++ == 0)
+        start = Clock::now();
+    }
+    record(spins, start);
+    m_position = position;
+    return &m_cells[position % m_maxSize];
+  };
+
+  void record(uint64_t spins, Clock::time_point start) {
+    if (spins == 0)
+      return;
+    m_sync.m_stats.add(SyncStats::kSpins, spins);
+    m_sync.m_stats.add(SyncStats::kWaitNs, nanosecondsSince(start));
+  };
+
+  const size_t m_maxSize;
+  std::vector<Cell> m_cells;
+  alignas(64) std::atomic<size_t> m_tail{0};
+  alignas(64) std::atomic<size_t> m_head{0};
+  ArraySync m_sync;
+  static thread_local size_t m_position; // claimed by the calling thread
+};
+
+template <class T>
+thread_local size_t TsQueue<T, ArraySync>::m_position = 0;
+
+//------------------------------------------------------------------------------
+// Useful type definitions
+using Action = std::function<void()>;
+using Duration = std::chrono::duration<float>;
+
+//------------------------------------------------------------------------------
+// Small dummy class representing a mail item.
+class MailItem {
+public:
+  enum class State : char {
+    kStart,
+    kFolded,
+    kStuffed,
+    kSealed,
+    kAddressed,
+    kStamped,
+    kMailed
+  };
+
+  MailItem() : m_id(0), m_state(State::kStart){};
+  MailItem(size_t id) : m_id(id), m_state(State::kStart){};
+  size_t getId() { return m_id; };
+  State getState() { return m_state; };
+  // Go through one step of the mail state machine, returns false once mailed
+  bool next(float timeScale) {
+    switch (m_state) {
+    case State::kStart:
+      doWork(State::kFolded, 0.12 * timeScale);
+      return true;
+    case State::kFolded:
+      doWork(State::kStuffed, 0.1 * timeScale);
+      return true;
+    case State::kStuffed:
+      doWork(State::kSealed, 0.24 * timeScale);
+      return true;
+    case State::kSealed:
+      doWork(State::kAddressed, 0.5 * timeScale);
+      return true;
+    case State::kAddressed:
+      doWork(State::kStamped, 0.05 * timeScale);
+      return true;
+    case State::kStamped:
+      doWork(State::kMailed, 0.7 * timeScale);
+      return false;
+    default:
+      return false;
+    }
+  };
+
+private:
+  size_t m_id;
+  State m_state;
+  void doWork(State newState, float deltaTf) {
+    if (deltaTf > 0.f)
+      std::this_thread::sleep_for(Duration(deltaTf));
+    m_state = newState;
+  };
+};
+
+//------------------------------------------------------------------------------
+// One stage of an item, then queue the next one, as in mailItemBetterDesign
+template <class Sync>
+void doMail(MailItem & item, TsQueue<Action *, Sync> * p_actionsQueue,
+            float timeScale, std::atomic<size_t> * p_nMailed) {
+  if (item.next(timeScale)) {
+    Action * work = new Action(std::bind(doMail<Sync>, item, p_actionsQueue,
+                                         timeScale, p_nMailed));
+    p_actionsQueue->push(work);
+  } else {
+    p_nMailed->fetch_add(1, std::memory_order_release);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Run the pipeline on the backend Sync and print its contention profile
+template <class Sync>
+void runPipeline(int nItems, int nThreads, float timeScale) {
+  TsQueue<Action *, Sync> actionsQueue(nItems + 1000);
+  std::atomic<size_t> nMailed{0};
+
+  auto work = [&] {
+    Action * action = nullptr;
+    while (nMailed.load(std::memory_order_acquire) < size_t(nItems)) {
+      if (actionsQueue.try_pop(action)) {
+        (*action)();
+        delete action;
+      }
+    }
+  };
+  auto start = Clock::now();
+  std::vector<std::thread> workerThreads;
+  for (int i = 0; i < nThreads - 1; ++i) // 1 thread is the main thread :)
+    workerThreads.emplace_back(work);
+  for (int i = 0; i < nItems; ++i) {
+    MailItem item(i);
+    actionsQueue.push(new Action(std::bind(doMail<Sync>, item, &actionsQueue,
+                                           timeScale, &nMailed)));
+  }
+  work();
+  for (auto & thr : workerThreads)
+    thr.join();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  SyncStats & stats = actionsQueue.getStats();
+  std::cout << std::setw(10) << Sync::kName << std::setw(10)
+            << elapsed.count() << std::setw(14)
+            << 6. * nItems / elapsed.count() << std::setw(14)
+            << stats.get(SyncStats::kAcquisitions) << std::setw(12)
+            << stats.get(SyncStats::kFailedPush) << std::setw(12)
+            << stats.get(SyncStats::kFailedPop) << std::setw(14)
+            << stats.get(SyncStats::kSpins) << std::setw(12)
+            << stats.get(SyncStats::kWaitNs) * 1e-6 << "\n";
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  // Get the arguments from command line and notify start
+  // Parse args
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <mail items> <n working threads> [time scale]"
+                 " [tm,mutex,ticket,mcs,array]\n";
+    return 1;
+  }
+
+  int nItems = std::stoi(argv[1]);
+  int nThreads = std::stoi(argv[2]);
+  float timeScale = argc > 3 ? std::stof(argv[3]) : 0.f;
+  std::vector<std::string> backends;
+  std::istringstream backendList(argc > 4 ? argv[4]
+                                          : "tm,mutex,ticket,mcs,array");
+  std::string backend;
+  while (std::getline(backendList, backend, ','))
+    backends.push_back(backend);
+
+  if (nItems <= 0 || nThreads <= 0 || nThreads > int(kMaxThreads) ||
+      timeScale < 0.f || backends.empty()) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+
+  std::cout << "Starting with " << nItems << " items and " << nThreads
+            << " threads, time scale " << timeScale << "\n"
+            << std::setw(10) << "backend" << std::setw(10) << "time [s]"
+            << std::setw(14) << "tasks/s" << std::setw(14) << "acquisitions"
+            << std::setw(12) << "failed push" << std::setw(12) << "failed pop"
+            << std::setw(14) << "spins" << std::setw(12) << "wait [ms]"
+            << "\n";
+  for (auto & name : backends) {
+    if (name == "tm") {
+      runPipeline<TmSync>(nItems, nThreads, timeScale);
+    } else if (name == "mutex") {
+      runPipeline<MutexSync>(nItems, nThreads, timeScale);
+    } else if (name == "ticket") {
+      runPipeline<TicketSync>(nItems, nThreads, timeScale);
+    } else if (name == "mcs") {
+      runPipeline<McsSync>(nItems, nThreads, timeScale);
+    } else if (name == "array") {
+      runPipeline<ArraySync>(nItems, nThreads, timeScale);
+    } else {
+      std::cerr << "Unknown backend " << name << "\n";
+      return 1;
+    }
+  }
+  std::cout << "Work finished, threads joined\n";
+}
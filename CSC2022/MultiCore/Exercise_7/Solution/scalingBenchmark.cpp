@@ -0,0 +1,158 @@
+/* Scalability benchmark of the mail item processors
+g++ scalingBenchmark.cpp -o scalingBenchmark -std=c++17 -Wall -Wextra
+-Wpedantic -Werror
+
+Usage: scalingBenchmark <directory of the executables> <time scale>
+                        <item counts> <thread counts> [repetitions]
+e.g.   scalingBenchmark . 1e-4 200,1000 1,2,4,8,16 3
+
+Runs mailItemProcessor, mailItemBetterDesign and animatedMailItemProcessor
+(compiled beforehand) for every combination of item and thread counts, with
+the stage durations multiplied by the time scale through the MAIL_TIME_SCALE
+environment variable. The best of the repetitions is kept.
+For every variant and item count the speedup is computed with respect to the
+smallest thread count, and fitted to Amdahl's law
+  S(n) = 1 / ((1 - P) + P / n)
+(the formula of Exercise_1/Solution/answers.txt) to estimate the parallel
+fraction P. The results are written as CSV on the standard output.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// The variants, and the extra arguments which make them run unattended
+struct Variant {
+  const char * name;
+  const char * extraArgs;
+};
+
+const Variant gVariants[] = {
+    {"mailItemProcessor", "fma none"},
+    {"mailItemBetterDesign", "normal 1 csv:/dev/null"},
+    {"animatedMailItemProcessor", "normal 1 csv:/dev/null"}};
+
+//------------------------------------------------------------------------------
+// Amdahl's law, as in answers.txt
+double amdahl(double n, double p) { return 1. / ((1. - p) + p / n); }
+
+// Least squares fit of P on the speedups measured relative to threads[0]
+double fitParallelFraction(const std::vector<int> & threads,
+                           const std::vector<double> & speedups) {
+  double bestP = 0.;
+  double bestChi2 = -1.;
+  for (int step = 0; step <= 10000; ++step) {
+    const double p = step * 1e-4;
+    double chi2 = 0.;
+    for (size_t i = 0; i < threads.size(); ++i) {
+      const double predicted = amdahl(threads[i], p) / amdahl(threads[0], p);
+      chi2 += (predicted - speedups[i]) * (predicted - speedups[i]);
+    }
+    if (bestChi2 < 0. || chi2 < bestChi2) {
+      bestChi2 = chi2;
+      bestP = p;
+    }
+  }
+  return bestP;
+}
+
+//------------------------------------------------------------------------------
+std::vector<int> parseList(const std::string & list) {
+  std::vector<int> values;
+  std::istringstream stream(list);
+  std::string value;
+  while (std::getline(stream, value, ','))
+    values.push_back(std::stoi(value));
+  return values;
+}
+
+//------------------------------------------------------------------------------
+// Run one configuration and return its duration in seconds: the "Elapsed
+// time" printed by the program if any, the wall time of the process otherwise
+double runOnce(const std::string & command) {
+  auto start = std::chrono::steady_clock::now();
+  FILE * pipe = popen(command.c_str(), "r");
+  if (!pipe)
+    return -1.;
+  double reported = -1.;
+  char line[4096];
+  while (fgets(line, sizeof(line), pipe)) {
+    double seconds;
+    if (std::sscanf(line, "Elapsed time: %lf s", &seconds) == 1)
+      reported = seconds;
+  }
+  const int status = pclose(pipe);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (status != 0)
+    return -1.;
+  return reported > 0. ? reported : elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc != 5 && argc != 6) {
+    std::cerr << "Usage: " << argv[0]
+              << " <directory of the executables> <time scale>"
+                 " <item counts> <thread counts> [repetitions]\n";
+    return 1;
+  }
+
+  const std::string directory = argv[1];
+  const std::string timeScale = argv[2];
+  std::vector<int> items = parseList(argv[3]);
+  std::vector<int> threads = parseList(argv[4]);
+  const int repetitions = argc == 6 ? std::stoi(argv[5]) : 1;
+
+  std::sort(threads.begin(), threads.end());
+  if (items.empty() || threads.empty() || threads[0] <= 0 ||
+      repetitions <= 0 || std::stod(timeScale) <= 0.) {
+    std::cerr << "Invalid input parameter(s) value(s)\n";
+    return 1;
+  }
+  setenv("MAIL_TIME_SCALE", timeScale.c_str(), 1);
+
+  std::cout << "variant,items,threads,seconds,throughput,speedup,efficiency,"
+               "fitted_P,amdahl_speedup\n";
+  for (auto & variant : gVariants) {
+    for (int nItems : items) {
+      std::vector<double> seconds;
+      for (int nThreads : threads) {
+        const std::string command =
+            directory + "/" + variant.name + " " + std::to_string(nItems) +
+            " " + std::to_string(nThreads) + " " + variant.extraArgs;
+        double best = -1.;
+        for (int r = 0; r < repetitions; ++r) {
+          const double t = runOnce(command);
+          if (t > 0. && (best < 0. || t < best))
+            best = t;
+        }
+        if (best < 0.) {
+          std::cerr << "Failed: " << command << "\n";
+          return 1;
+        }
+        std::cerr << variant.name << " " << nItems << " items " << nThreads
+                  << " threads: " << best << " s\n";
+        seconds.push_back(best);
+      }
+
+      std::vector<double> speedups;
+      for (double t : seconds)
+        speedups.push_back(seconds[0] / t);
+      const double p = fitParallelFraction(threads, speedups);
+      for (size_t i = 0; i < threads.size(); ++i) {
+        const double efficiency = speedups[i] * threads[0] / threads[i];
+        std::cout << variant.name << "," << nItems << "," << threads[i] << ","
+                  << seconds[i] << "," << nItems / seconds[i] << ","
+                  << speedups[i] << "," << efficiency << "," << p << ","
+                  << amdahl(threads[i], p) / amdahl(threads[0], p) << "\n";
+      }
+    }
+  }
+}
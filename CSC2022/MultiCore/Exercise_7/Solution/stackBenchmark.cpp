@@ -0,0 +1,390 @@
+/* Throughput of the TM stack against the lock free stack
+g++ stackBenchmark.cpp -o stackBenchmark -std=c++17 -fgnu-tm -pthread -O2
+-Wall -Wextra -Wpedantic -Werror
+
+Usage: stackBenchmark [thread counts] [seconds per run]
+e.g.   stackBenchmark 1,2,4,8,16,32,64 0.5
+
+TsStack and LockFreeStack are the ones of animatedMailItemProcessor.cpp.
+The stack holds 1000 slots, like the actions queue there, and starts with
+500 distinct values. Every thread pops a value and pushes it back, as fast
+as it can, for the given time (default 0.5 s). The pops and pushes per
+second are printed, and at the end the stack is drained to check that every
+value is still there exactly once.
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A possible implementation of a bounded thread safe queue using tm
+// The methods holding a transaction are kept out of line: inlined at -O2,
+// the setjmp of the transaction makes GCC warn that the locals of the
+// callers might be clobbered (-Wclobbered).
+
+template <class T> class TsStack {
+public:
+  TsStack(size_t queueSize)
+      : m_maxSize(queueSize), m_currentSize(0), m_items(m_maxSize){};
+  //---------
+  __attribute__((noinline)) size_t getNitems() {
+    bool assigned = false;
+    size_t currentSize = 0;
+    while (!assigned)
+      __transaction_atomic {
+        currentSize = m_currentSize;
+        assigned = true;
+      }
+    return currentSize;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  __attribute__((noinline)) bool try_push(const T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize < m_maxSize) {
+        m_items[m_currentSize] = (item);
+        m_currentSize++;
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  __attribute__((noinline)) bool try_pop(T & item) {
+    bool success = false;
+    __transaction_atomic {
+      if (m_currentSize > 0) {
+        m_currentSize--;
+        item = m_items[m_currentSize];
+        success = true;
+      }
+    }
+    return success;
+  };
+
+  //--------
+  void dump() { // Non thread safe: here for debugging
+    for (int i = 0; i < m_currentSize; ++i) {
+      std::cout << "Item " << i << " " << m_items[i] << "\n";
+    }
+  }
+
+private:
+  const size_t m_maxSize;
+  size_t m_currentSize;
+  std::vector<T> m_items;
+};
+//------------------------------------------------------------------------------
+// The same interface, lock free: a Treiber stack over a preallocated array of
+// nodes, plus an elimination array.
+// The top of the stack and the list of free nodes hold node indices tagged
+// with a counter incremented at every change, so that a compare-and-swap
+// cannot succeed on a top which was popped and pushed back in between (ABA).
+// When the top is contended, a push offers its node in a random slot of the
+// elimination array for a short while, and a pop which fails on the top looks
+// for such an offer: the two cancel each other without touching the top.
+
+template <class T> class LockFreeStack {
+public:
+  LockFreeStack(size_t stackSize)
+      : m_maxSize(stackSize), m_nodes(m_maxSize), m_top(pack(kNil, 0)),
+        m_free(pack(m_maxSize > 0 ? 0 : kNil, 0)), m_nItems(0) {
+    for (size_t i = 0; i < m_maxSize; ++i)
+      m_nodes[i].next.store(i + 1 < m_maxSize ? i + 1 : kNil,
+                            std::memory_order_relaxed);
+  };
+  //---------
+  size_t getNitems() {
+    // the counter can be transiently negative: a pop may be counted before
+    // the push of the same node
+    const int64_t nItems = m_nItems.load(std::memory_order_relaxed);
+    return nItems > 0 ? nItems : 0;
+  }
+  //---------
+  bool isFull() { return getNitems() == m_maxSize; };
+  //--------
+  void push(const T & item) {
+    while (!try_push(item))
+      ;
+  };
+  //---------
+  bool try_push(const T & item) {
+    const uint32_t node = popIndex(m_free);
+    if (node == kNil)
+      return false; // full
+    m_nodes[node].item = item;
+    while (true) {
+      if (tryPushIndex(m_top, node)) {
+        m_nItems.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      if (tryEliminatePush(node))
+        return true;
+    }
+  };
+
+  //---------
+  void pop(T & item) {
+    while (!try_pop(item))
+      ;
+  };
+  //---------
+  bool try_pop(T & item) {
+    uint32_t node = kNil;
+    while (true) {
+      if (tryPopIndex(m_top, node)) {
+        if (node == kNil)
+          return false; // empty
+        m_nItems.fetch_sub(1, std::memory_order_relaxed);
+        break;
+      }
+      if (tryEliminatePop(node))
+        break;
+    }
+    item = m_nodes[node].item;
+    pushIndex(m_free, node);
+    return true;
+  };
+
+private:
+  static constexpr uint32_t kNil = ~uint32_t(0);
+  static constexpr size_t kEliminationSlots = 16;
+  static constexpr int kEliminationSpins = 128;
+
+  struct Node {
+    T item;
+    std::atomic<uint32_t> next;
+  };
+
+  // A head word: the index of the first node in the low 32 bits, the tag in
+  // the high 32 bits
+  static uint64_t pack(uint32_t index, uint32_t tag) {
+    return uint64_t(tag) << 32 | index;
+  };
+  static uint32_t indexOf(uint64_t head) { return uint32_t(head); };
+  static uint32_t tagOf(uint64_t head) { return uint32_t(head >> 32); };
+
+  // One attempt to push the node on the list starting at head
+  bool tryPushIndex(std::atomic<uint64_t> & head, uint32_t node) {
+    uint64_t current = head.load(std::memory_order_relaxed);
+    m_nodes[node].next.store(indexOf(current), std::memory_order_relaxed);
+    return head.compare_exchange_weak(current,
+                                      pack(node, tagOf(current) + 1),
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed);
+  };
+
+  // One attempt to pop the first node: false if the list changed meanwhile,
+  // node set to kNil if the list is empty. The next index of a node popped
+  // by somebody else may be read, but then the tag makes the CAS fail.
+  bool tryPopIndex(std::atomic<uint64_t> & head, uint32_t & node) {
+    uint64_t current = head.load(std::memory_order_acquire);
+    node = indexOf(current);
+    if (node == kNil)
+      return true;
+    const uint32_t next = m_nodes[node].next.load(std::memory_order_relaxed);
+    return head.compare_exchange_weak(current, pack(next, tagOf(current) + 1),
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed);
+  };
+
+  void pushIndex(std::atomic<uint64_t> & head, uint32_t node) {
+    while (!tryPushIndex(head, node))
+      ;
+  };
+
+  uint32_t popIndex(std::atomic<uint64_t> & head) {
+    uint32_t node = kNil;
+    while (!tryPopIndex(head, node))
+      ;
+    return node;
+  };
+
+  //---------
+  // Elimination. A slot word holds a state in the 2 high bits, a tag in the
+  // next 30 and a node index in the low 32. Only pushes wait in the slots.
+  enum SlotState : uint64_t { kEmpty = 0, kOffered = 1, kTaken = 2 };
+
+  static uint64_t packSlot(uint64_t state, uint64_t tag, uint32_t index) {
+    return state << 62 | (tag & 0x3fffffff) << 32 | index;
+  };
+  static uint64_t stateOf(uint64_t slot) { return slot >> 62; };
+  static uint64_t slotTagOf(uint64_t slot) {
+    return (slot >> 32) & 0x3fffffff;
+  };
+
+  std::atomic<uint64_t> & randomSlot() {
+    thread_local uint32_t tState =
+        uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) |
+        1;
+    tState ^= tState << 13; // xorshift32
+    tState ^= tState >> 17;
+    tState ^= tState << 5;
+    return m_elimination[tState % kEliminationSlots].word;
+  };
+
+  // Offer the node for a while, true if a pop took it
+  bool tryEliminatePush(uint32_t node) {
+    std::atomic<uint64_t> & slot = randomSlot();
+    uint64_t current = slot.load(std::memory_order_relaxed);
+    if (stateOf(current) != kEmpty)
+      return false;
+    const uint64_t offer = packSlot(kOffered, slotTagOf(current) + 1, node);
+    if (!slot.compare_exchange_strong(current, offer,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed))
+      return false;
+    for (int i = 0; i < kEliminationSpins; ++i)
+      if (slot.load(std::memory_order_relaxed) != offer)
+        break;
+    uint64_t expected = offer;
+    const uint64_t empty = packSlot(kEmpty, slotTagOf(offer), 0);
+    if (slot.compare_exchange_strong(expected, empty,
+                                     std::memory_order_relaxed))
+      return false; // withdrawn, nobody came
+    // taken: only the pusher can free the slot again
+    slot.store(empty, std::memory_order_relaxed);
+    return true;
+  };
+
+  // Take a node offered by a push, if any
+  bool tryEliminatePop(uint32_t & node) {
+    std::atomic<uint64_t> & slot = randomSlot();
+    uint64_t current = slot.load(std::memory_order_relaxed);
+    if (stateOf(current) != kOffered)
+      return false;
+    if (!slot.compare_exchange_strong(
+            current, packSlot(kTaken, slotTagOf(current), 0),
+            std::memory_order_acquire, std::memory_order_relaxed))
+      return false;
+    node = uint32_t(current);
+    return true;
+  };
+
+  struct alignas(64) EliminationSlot {
+    std::atomic<uint64_t> word{0};
+  };
+
+  const size_t m_maxSize;
+  std::vector<Node> m_nodes;
+  alignas(64) std::atomic<uint64_t> m_top;
+  alignas(64) std::atomic<uint64_t> m_free;
+  alignas(64) std::atomic<int64_t> m_nItems;
+  EliminationSlot m_elimination[kEliminationSlots];
+};
+
+//------------------------------------------------------------------------------
+// Fill with the values 0 .. nValues-1
+template <class Stack> void fill(Stack & stack, size_t nValues) {
+  for (size_t v = 0; v < nValues; ++v)
+    stack.push(v);
+}
+
+// Drain the stack, true if every value was there exactly once
+template <class Stack> bool drainAndCheck(Stack & stack, size_t nValues) {
+  std::vector<int> seen(nValues, 0);
+  size_t value = 0;
+  bool correct = stack.getNitems() == nValues;
+  while (stack.try_pop(value))
+    correct &= value < nValues && ++seen[value] == 1;
+  for (int count : seen)
+    correct &= count == 1;
+  return correct;
+}
+
+//------------------------------------------------------------------------------
+// Pop and push back for 'seconds' on nThreads, returns the operations per
+// second, or a negative number if values were lost or duplicated
+template <class Stack> double benchmark(int nThreads, double seconds) {
+  const size_t kSize = 1000;
+  const size_t kValues = 500;
+  Stack stack(kSize);
+  fill(stack, kValues);
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> nOperations{0};
+  auto work = [&] {
+    uint64_t n = 0;
+    size_t value = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      if (stack.try_pop(value)) {
+        stack.push(value);
+        n += 2;
+      }
+    }
+    nOperations.fetch_add(n);
+  };
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i)
+    threads.emplace_back(work);
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (auto & thr : threads)
+    thr.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (!drainAndCheck(stack, kValues))
+    return -1.;
+  return nOperations.load() / elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char ** argv) {
+
+  if (argc > 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " [thread counts] [seconds per run]\n";
+    return 1;
+  }
+
+  std::vector<int> threadCounts;
+  std::istringstream threadList(argc > 1 ? argv[1] : "1,2,4,8,16,32,64");
+  std::string count;
+  while (std::getline(threadList, count, ','))
+    threadCounts.push_back(std::stoi(count));
+  const double seconds = argc > 2 ? std::stod(argv[2]) : 0.5;
+
+  for (int n : threadCounts) {
+    if (n <= 0 || seconds <= 0.) {
+      std::cerr << "Invalid input parameter(s) value(s)\n";
+      return 1;
+    }
+  }
+
+  std::cout << std::setw(8) << "threads" << std::setw(16) << "tm ops/s"
+            << std::setw(18) << "lock free ops/s" << std::setw(10)
+            << "ratio\n";
+  bool correct = true;
+  for (int n : threadCounts) {
+    const double tm = benchmark<TsStack<size_t>>(n, seconds);
+    const double lockFree = benchmark<LockFreeStack<size_t>>(n, seconds);
+    correct &= tm > 0. && lockFree > 0.;
+    std::cout << std::setw(8) << n << std::setw(16) << tm << std::setw(18)
+              << lockFree << std::setw(10) << lockFree / tm << "\n";
+  }
+  if (!correct)
+    std::cout << "ERROR: values lost or duplicated\n";
+  return correct ? 0 : 1;
+}